@@ -1,119 +1,97 @@
 #!/bin/bash
-
-set -e -u
-
-ab_n=1000
-ab_c=100
-
-image=henet.git
-debug_test=dist/Debug/GNU-Linux-x86/$image
-release_test=dist/Release/GNU-Linux-x86/$image
-
-function start_ab_benchmark()
-{
-    local name=$1
-
-    sleep 1
-    $name &
-    sleep 1
-}
-
-function stop_ab_benchmark()
-{
-    local name=$1
-
-    killall $name
-
-    return 0
-}
-
-function run_ab_benchmark()
-{
-    local num=$1
-    local con=$2
-    local name=$3
-
-    ab -n $num -c $con -g $name.plt http://localhost:8080/ > $name.txt
-}
-
 #
-# Debug run
+# Runs every server mode against heload over loopback, one JSON line per run
+# in benchmark.json:
 #
-start_ab_benchmark $debug_test;
-run_ab_benchmark   $ab_n, $ab_c, "ab-debug-1";
-run_ab_benchmark   $ab_n, $ab_c, "ab-debug-2";
-run_ab_benchmark   $ab_n, $ab_c, "ab-debug-3";
-stop_ab_benchmark  $debug_test;
-
-#
-# Release run
-#
-start_ab_benchmark $release_test;
-run_ab_benchmark   $ab_n, $ab_c, "ab-release-1";
-run_ab_benchmark   $ab_n, $ab_c, "ab-release-2";
-run_ab_benchmark   $ab_n, $ab_c, "ab-release-3";
-stop_ab_benchmark  $release_test;
-
-#
-# Render benchmark with gnuplot
-#
-gnuplot << _EO_PLOT_
-
-#
-# Benchmark template using Apache ab and GNU plot
-#
-# see http://blog.secaserver.com/2012/03/web-server-benchmarking-apache-benchmark/
+#   ./benchmark.sh [Debug|Release]
 #
-
-#
-# Legend for plt file:
-#       ctime: Connection Time
-#       dtime: Processing Time
-#       ttime: Total Time
-#       wait: Waiting Time
+# Closed loop runs measure peak throughput, open loop runs measure latency at a
+# fixed request rate with coordinated omission corrected.
 #
 
-# output as png image
-set terminal pngcairo size 800,600
+set -e -u
 
-# save file to "benchmark.png"
-set output "benchmark.png"
+conf=${1:-Release}
+dist=dist/$conf/GNU-Linux-x86
+server=$dist/henet.git
+heload=$dist/heload
+target=tcp:127.0.0.1:8080
+output=benchmark.json
 
-# aspect ratio for image size
-set size 1,1
+duration=${BENCH_DURATION:-10}
+connections=${BENCH_CONNECTIONS:-100}
+threads=${BENCH_THREADS:-2}
+rate=${BENCH_RATE:-20000}
+body=${BENCH_BODY:-128}
 
-# graph title
-set title "Benchmark for henet. `date`"
+# Event loops keep connections open, the thread per connection modes close after each reply
+keep_alive_modes="http uring"
+close_modes="block async epoll reactors pool"
 
-# enable grid on y-axis
-# set grid y
+function start_server()
+{
+    local mode=$1
 
-# x-axis label
-set xlabel "Request"
+    $server $mode $body > /dev/null &
+    server_pid=$!
 
-# y-axis label
-set ylabel "Response Time (ms)"
+    # Wait for the port, the server may need a moment to bind
+    for i in $(seq 1 50)
+    do
+        if (exec 3<>/dev/tcp/127.0.0.1/8080) 2> /dev/null
+        then
+            return 0
+        fi
 
-# styles
-unset border
-set grid back
+        sleep 0.1
+    done
 
-set style line 1 lt 1 lw 1 linecolor rgb "#A00000"
-set style line 2 lt 1 lw 1 linecolor rgb "#B00000"
-set style line 3 lt 1 lw 1 linecolor rgb "#C00000"
+    echo "Server mode $mode did not start." >&2
+    return 1
+}
 
-set style line 4 lt 1 lw 1 linecolor rgb "#00A000"
-set style line 5 lt 1 lw 1 linecolor rgb "#00B000"
-set style line 6 lt 1 lw 1 linecolor rgb "#00C000"
+function stop_server()
+{
+    kill -TERM $server_pid
+    wait $server_pid || true
+}
 
-# plot data from bench1.tsv,bench2.tsv and bench3.tsv using column 10 with smooth sbezier lines
-plot \
-    "ab-debug-1.plt"   using 10 smooth sbezier with lines ls 1 title "ab -n $ab_n -c $ab_c debug 1   ", \
-    "ab-debug-2.plt"   using 10 smooth sbezier with lines ls 2 title "ab -n $ab_n -c $ab_c debug 2   ", \
-    "ab-debug-3.plt"   using 10 smooth sbezier with lines ls 3 title "ab -n $ab_n -c $ab_c debug 3   ", \
-    "ab-release-1.plt" using 10 smooth sbezier with lines ls 4 title "ab -n $ab_n -c $ab_c release 1 ", \
-    "ab-release-2.plt" using 10 smooth sbezier with lines ls 5 title "ab -n $ab_n -c $ab_c release 2 ", \
-    "ab-release-3.plt" using 10 smooth sbezier with lines ls 6 title "ab -n $ab_n -c $ab_c release 3 "
+function run_load()
+{
+    local label=$1
+    shift
 
-_EO_PLOT_
+    $heload -l $label -c $connections -t $threads -d $duration "$@" $target | tee -a $output
+}
 
+if [ ! -x $server ] || [ ! -x $heload ]
+then
+    echo "Build first: make CONF=$conf heload" >&2
+    exit 1
+fi
+
+: > $output
+
+for mode in $keep_alive_modes $close_modes
+do
+    flag=-k
+    if [[ " $close_modes " == *" $mode "* ]]
+    then
+        flag=-K
+    fi
+
+    start_server $mode
+    run_load $mode-peak $flag
+    run_load $mode-rate-$rate $flag -r $rate
+    stop_server
+done
+
+# Same-host clients: the http mode again over an abstract unix socket, no TCP stack
+target=unix:@henet-benchmark
+$server http $body $target > /dev/null &
+server_pid=$!
+sleep 1
+
+run_load http-unix-peak -k
+run_load http-unix-rate-$rate -k -r $rate
+stop_server
@@ -0,0 +1,319 @@
+/*
+ * File:   hebench.cpp
+ *
+ * Microbenchmarks for the henet building blocks. One line per case:
+ *
+ *     name    median ns/op    min ns/op    iterations per sample
+ *
+ * Each case is calibrated until a sample takes hebench_sample_ms, then sampled
+ * hebench_samples times, the median keeps the output stable between runs.
+ *
+ *     hebench [filter]     runs the cases whose name contains filter
+ */
+
+#include "henet.h"
+
+#include <sys/resource.h>
+
+namespace
+{
+    const unsigned long hebench_sample_ms = 20;
+    const size_t hebench_samples = 7;
+
+    // Keeps results observable so the optimizer cannot drop the measured work
+    volatile size_t sink = 0;
+
+    std::string filter;
+
+    // fn(n) performs the operation n times
+    template <typename F>
+    void bench(const std::string& name, F fn)
+    {
+        typedef std::chrono::steady_clock clock;
+
+        if (!filter.empty() && name.find(filter) == std::string::npos)
+        {
+            return;
+        }
+
+        auto sample = [&](size_t n)
+        {
+            const clock::time_point start = clock::now();
+            fn(n);
+            return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        };
+
+        // Warm up and calibrate: double until a sample is long enough to time reliably
+        size_t iterations = 1;
+        while (sample(iterations) < hebench_sample_ms * 1e6 && iterations < (1ULL << 40))
+        {
+            iterations *= 2;
+        }
+
+        std::vector<double> per_op;
+        for (size_t i = 0; i < hebench_samples; i++)
+        {
+            per_op.push_back(sample(iterations) / iterations);
+        }
+
+        std::sort(per_op.begin(), per_op.end());
+
+        std::cout << std::left << std::setw(40) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(14) << per_op[per_op.size() / 2]
+                  << std::setw(14) << per_op.front()
+                  << std::setw(14) << iterations << std::endl;
+    }
+
+    void skip(const std::string& name, const std::string& reason)
+    {
+        if (filter.empty() || name.find(filter) != std::string::npos)
+        {
+            std::cout << std::left << std::setw(40) << name << "skipped: " << reason << std::endl;
+        }
+    }
+
+    std::pair<ha::socket, ha::socket> make_pair()
+    {
+        int fds[2];
+
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+        {
+            throw std::runtime_error(std::string("socketpair() exception: ") + ::strerror(errno));
+        }
+
+        return std::make_pair(ha::socket(fds[0]), ha::socket(fds[1]));
+    }
+
+    void bench_socket()
+    {
+        for (size_t size : { 64, 4096, 65536 })
+        {
+            std::pair<ha::socket, ha::socket> pair = make_pair();
+            const std::vector<unsigned char> data(size, 'x');
+            ha::buffer buf;
+
+            bench("socket/write+read_into/" + std::to_string(size), [&](size_t n)
+            {
+                for (size_t i = 0; i < n; i++)
+                {
+                    pair.first.write(data);
+                    sink += pair.second.read_into(buf);
+                    buf.clear();
+                }
+            });
+
+            bench("socket/write+read/" + std::to_string(size), [&](size_t n)
+            {
+                for (size_t i = 0; i < n; i++)
+                {
+                    pair.first.write(data);
+                    sink += pair.second.read().size();
+                }
+            });
+
+            bench("socket/writev/" + std::to_string(size), [&](size_t n)
+            {
+                const ha::slice parts[] = { ha::slice(data.data(), size / 2), ha::slice(data.data(), size - size / 2) };
+
+                for (size_t i = 0; i < n; i++)
+                {
+                    pair.first.writev(parts, 2);
+                    sink += pair.second.read_into(buf);
+                    buf.clear();
+                }
+            });
+        }
+    }
+
+    void bench_write_file()
+    {
+        for (size_t size : { 4096, 65536, 1048576 })
+        {
+            char path[] = "/tmp/hebench.XXXXXX";
+            int fd = ::mkstemp(path);
+
+            if (fd < 0)
+            {
+                throw std::runtime_error(std::string("mkstemp() exception: ") + ::strerror(errno));
+            }
+
+            ::unlink(path);
+            ha::socket file(fd);
+            const std::vector<unsigned char> data(size, 'x');
+
+            if (::write(fd, data.data(), size) != static_cast<ssize_t>(size))
+            {
+                throw std::runtime_error(std::string("write() exception: ") + ::strerror(errno));
+            }
+
+            // Nonblocking writer: sendfile stops at a full socket buffer, the reader drains it
+            std::pair<ha::socket, ha::socket> pair = make_pair();
+            pair.first.nonblocking();
+            pair.second.nonblocking();
+            ha::buffer buf;
+
+            bench("socket/write_file/" + std::to_string(size), [&](size_t n)
+            {
+                for (size_t i = 0; i < n; i++)
+                {
+                    off_t offset = 0;
+
+                    while (static_cast<size_t>(offset) < size)
+                    {
+                        pair.first.write_file(fd, offset, size - offset);
+                        sink += pair.second.read_into(buf);
+                        buf.clear();
+                    }
+                }
+            });
+        }
+    }
+
+    void bench_epoll()
+    {
+        // 50k registrations need as many descriptors
+        struct rlimit limit;
+        if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            ::setrlimit(RLIMIT_NOFILE, &limit);
+        }
+
+        for (size_t registered : { 1, 1000, 50000 })
+        {
+            const std::string name = "epoll/wait+dispatch/" + std::to_string(registered);
+
+            if (filter.size() && name.find(filter) == std::string::npos)
+            {
+                continue;
+            }
+
+            if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < registered + 64)
+            {
+                skip(name, "RLIMIT_NOFILE is " + std::to_string(limit.rlim_cur));
+                continue;
+            }
+
+            ha::epoll ep;
+            std::vector<ha::socket> fds;
+            fds.reserve(registered);
+
+            for (size_t i = 0; i < registered; i++)
+            {
+                fds.push_back(ha::socket(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)));
+                ep.add_socket(fds.back(), 0, false);
+            }
+
+            // One ready descriptor among them all: the cost must not grow with the idle ones
+            const ha::socket& ready = fds[registered / 2];
+            const uint64_t one = 1;
+
+            bench(name, [&](size_t n)
+            {
+                for (size_t i = 0; i < n; i++)
+                {
+                    // Edge-triggered: every write is a new edge
+                    sink += ::write(ready, &one, sizeof(one));
+                    ep.wait(1);
+                    sink += ep.dispatch([](ha::epoll_state state, const ha::socket& sock)
+                    {
+                        sink += static_cast<size_t>(state);
+                    });
+                }
+            });
+        }
+    }
+
+    void bench_address()
+    {
+        bench("util/parse_connection_string/any", [](size_t n)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                sink += ha::util::parse_connection_string("tcp::8080").port;
+            }
+        });
+
+        bench("util/parse_connection_string/numeric", [](size_t n)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                sink += ha::util::parse_connection_string("tcp:127.0.0.1:8080").port;
+            }
+        });
+
+        bench("resolver/cached", [](size_t n)
+        {
+            ha::resolver names;
+            names.resolve("localhost", 8080);
+
+            for (size_t i = 0; i < n; i++)
+            {
+                sink += names.resolve("localhost", 8080).size();
+            }
+        });
+
+        bench("address/from_string", [](size_t n)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                ha::address addr("192.168.1.1", 8080);
+                sink += addr.size();
+            }
+        });
+
+        bench("address/from_in_addr", [](size_t n)
+        {
+            in_addr any;
+            any.s_addr = INADDR_ANY;
+
+            for (size_t i = 0; i < n; i++)
+            {
+                ha::address addr(AF_INET, any, 8080);
+                sink += addr.size();
+            }
+        });
+
+        bench("address/str", [](size_t n)
+        {
+            ha::address addr("192.168.1.1", 8080);
+
+            for (size_t i = 0; i < n; i++)
+            {
+                sink += addr.str().size();
+            }
+        });
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int rc = EXIT_SUCCESS;
+
+    if (argc > 1)
+    {
+        filter = argv[1];
+    }
+
+    try
+    {
+        ::signal(SIGPIPE, SIG_IGN);
+
+        std::cout << std::left << std::setw(40) << "name" << std::right
+                  << std::setw(14) << "ns/op" << std::setw(14) << "min ns/op" << std::setw(14) << "iterations"
+                  << std::endl;
+
+        bench_socket();
+        bench_write_file();
+        bench_epoll();
+        bench_address();
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+
+        rc = EXIT_FAILURE;
+    }
+
+    return rc;
+}
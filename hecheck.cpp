@@ -0,0 +1,175 @@
+/*
+ * File:   hecheck.cpp
+ *
+ * Regression checks for the henet building blocks. One line per case:
+ *
+ *     name    ok | FAILED: what
+ *
+ * A case that hangs is ended by hecheck_timeout_s, the exit status tells whether all passed.
+ *
+ *     hecheck [filter]     runs the cases whose name contains filter
+ */
+
+#include "henet.h"
+
+namespace
+{
+    const unsigned hecheck_timeout_s = 10;
+
+    std::string filter;
+    size_t failures = 0;
+
+    // fn() returns an empty string on success, what went wrong otherwise
+    template <typename F>
+    void check(const std::string& name, F fn)
+    {
+        if (!filter.empty() && name.find(filter) == std::string::npos)
+        {
+            return;
+        }
+
+        std::string failure;
+
+        try
+        {
+            failure = fn();
+        }
+        catch(std::exception& e)
+        {
+            failure = std::string("exception: ") + e.what();
+        }
+
+        if (failure.empty())
+        {
+            std::cout << std::left << std::setw(48) << name << "ok" << std::endl;
+        }
+        else
+        {
+            std::cout << std::left << std::setw(48) << name << "FAILED: " << failure << std::endl;
+            failures++;
+        }
+    }
+
+    void on_alarm(int)
+    {
+        static const char message[] = "hecheck: timed out\n";
+        ssize_t rc = ::write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void)rc;
+        ::_exit(EXIT_FAILURE);
+    }
+
+    template <typename P>
+    ha::parse_state parse(P& parser, const std::string& message)
+    {
+        return parser.parse(reinterpret_cast<const unsigned char*>(message.data()), message.size());
+    }
+
+    void check_http_parser()
+    {
+        // Message framing must not be ambiguous (RFC 7230, 3.3.3)
+        const struct
+        {
+            const char* name;
+            const char* headers;
+            ha::parse_state expected;
+        }
+        cases[] =
+        {
+            { "repeated Content-Length", "Content-Length: 2\r\nContent-Length: 2\r\n", ha::parse_state::PARSE_COMPLETE },
+            { "conflicting Content-Length", "Content-Length: 2\r\nContent-Length: 12\r\n", ha::parse_state::PARSE_ERROR },
+            { "Content-Length with chunked", "Content-Length: 2\r\nTransfer-Encoding: chunked\r\n", ha::parse_state::PARSE_ERROR },
+            { "chunked with Content-Length", "Transfer-Encoding: chunked\r\nContent-Length: 2\r\n", ha::parse_state::PARSE_ERROR }
+        };
+
+        for (const auto& c : cases)
+        {
+            const std::string headers = c.headers;
+            const ha::parse_state expected = c.expected;
+
+            check(std::string("http_request/") + c.name, [&]()
+            {
+                ha::http_request request;
+                ha::parse_state rc = parse(request, "POST / HTTP/1.1\r\nHost: x\r\n" + headers + "\r\nok");
+
+                return rc == expected ? std::string() : std::string("unexpected parse state");
+            });
+
+            check(std::string("http_response/") + c.name, [&]()
+            {
+                ha::http_response response;
+                ha::parse_state rc = parse(response, "HTTP/1.1 200 OK\r\n" + headers + "\r\nok");
+
+                return rc == expected ? std::string() : std::string("unexpected parse state");
+            });
+        }
+    }
+
+    void check_http_client()
+    {
+        check("http_client/connect failure returns from run", []()
+        {
+            ha::http_client client;
+            std::string error;
+            bool called = false;
+
+            client.get("unix:/tmp/hecheck-does-not-exist.sock", "/",
+                [&](const ha::http_response&, const std::string& what)
+                {
+                    called = true;
+                    error = what;
+                });
+
+            const size_t completed = client.run(100);
+
+            if (!called || completed != 1)
+            {
+                return std::string("handler not run, completed ") + std::to_string(completed);
+            }
+
+            if (error.empty())
+            {
+                return std::string("no error reported");
+            }
+
+            if (client.pending())
+            {
+                return std::string("still pending");
+            }
+
+            return std::string();
+        });
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int rc = EXIT_SUCCESS;
+
+    if (argc > 1)
+    {
+        filter = argv[1];
+    }
+
+    try
+    {
+        ::signal(SIGPIPE, SIG_IGN);
+        ::signal(SIGALRM, on_alarm);
+        ::alarm(hecheck_timeout_s);
+
+        check_http_parser();
+        check_http_client();
+
+        if (failures)
+        {
+            rc = EXIT_FAILURE;
+        }
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+
+        rc = EXIT_FAILURE;
+    }
+
+    return rc;
+}
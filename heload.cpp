@@ -0,0 +1,498 @@
+/*
+ * File:   heload.cpp
+ *
+ * HTTP load generator for henet servers, one JSON result line on stdout.
+ *
+ * Open loop: requests are scheduled at a fixed rate whether or not earlier ones
+ * finished, and latency counts from the scheduled time, not from the send. A stalled
+ * server therefore shows up in the percentiles instead of silently slowing the load
+ * down (coordinated omission). With no rate every connection sends back to back.
+ */
+
+#include "henet.h"
+
+namespace
+{
+    struct options
+    {
+        std::string target;
+        std::string path;
+        std::string label;
+        size_t connections;
+        size_t threads;
+        double rate;
+        double duration;
+        bool keep_alive;
+        size_t payload;
+    };
+
+    void usage()
+    {
+        std::cerr << "Usage: heload [-c connections] [-t threads] [-r requests/s] [-d seconds]\n"
+                  << "              [-k|-K] [-s payload bytes] [-l label] [tcp:host:port [path]]\n"
+                  << "    -r 0 (default) sends back to back, -K closes the connection after each request\n";
+    }
+
+    // Response head fields the generator needs, length is 0 until the head is complete
+    struct response_head
+    {
+        size_t length;
+        size_t content_length;
+        int status;
+        bool close;
+    };
+
+    bool parse_head(const unsigned char* data, size_t size, response_head& head)
+    {
+        static const char terminator[] = "\r\n\r\n";
+        const char* begin = reinterpret_cast<const char*>(data);
+        const char* end = std::search(begin, begin + size, terminator, terminator + 4);
+
+        if (end == begin + size)
+        {
+            return false;
+        }
+
+        head.length = end - begin + 4;
+        head.content_length = 0;
+        head.status = 0;
+        head.close = false;
+
+        const char* line = begin;
+        while (line < end)
+        {
+            const char* eol = std::search(line, end + 2, terminator, terminator + 2);
+            const char* colon = std::find(line, eol, ':');
+
+            if (line == begin)
+            {
+                // HTTP/1.1 200 OK
+                const char* space = std::find(line, eol, ' ');
+                head.status = space < eol ? std::atoi(std::string(space + 1, eol).c_str()) : 0;
+            }
+            else if (colon < eol)
+            {
+                const ha::string_ref name(line, colon - line);
+                const char* value = colon + 1;
+
+                while (value < eol && *value == ' ')
+                {
+                    value++;
+                }
+
+                if (name.iequals("Content-Length"))
+                {
+                    head.content_length = std::strtoul(std::string(value, eol).c_str(), 0, 10);
+                }
+                else if (name.iequals("Connection"))
+                {
+                    head.close = ha::string_ref(value, eol - value).icontains("close");
+                }
+            }
+
+            line = eol + 2;
+        }
+
+        return true;
+    }
+
+    // One thread's share of the connections and of the rate
+    class generator
+    {
+        public:
+            typedef std::chrono::steady_clock clock;
+
+            generator(const options& opts, size_t connections, double rate)
+                : opts_(opts),
+                  connections_(connections),
+                  interval_(rate > 0 ? std::chrono::duration_cast<clock::duration>(
+                          std::chrono::duration<double>(1.0 / rate)) : clock::duration::zero()),
+                  request_(),
+                  ep_(),
+                  sessions_(),
+                  idle_(),
+                  backlog_(),
+                  latencies_(),
+                  completed_(0),
+                  errors_(0),
+                  unfinished_(0),
+                  bytes_(0)
+            {
+                std::ostringstream request;
+                request << (opts.payload ? "POST " : "GET ") << opts.path << " HTTP/1.1\r\n"
+                        << "Host: " << opts.target << "\r\n";
+
+                if (!opts.keep_alive)
+                {
+                    request << "Connection: close\r\n";
+                }
+
+                if (opts.payload)
+                {
+                    request << "Content-Length: " << opts.payload << "\r\n\r\n" << std::string(opts.payload, 'x');
+                }
+                else
+                {
+                    request << "\r\n";
+                }
+
+                request_ = request.str();
+            }
+
+            void run(clock::time_point start, clock::time_point end)
+            {
+                for (size_t i = 0; i < connections_; i++)
+                {
+                    sessions_.push_back(std::unique_ptr<session>(new session()));
+                    open(*sessions_.back());
+                    idle_.push_back(sessions_.back().get());
+                }
+
+                // In-flight requests get a grace period to finish after the run
+                const clock::time_point grace = end + std::chrono::seconds(2);
+                clock::time_point next = start;
+                size_t busy = 0;
+
+                auto issue = [&](session& s, clock::time_point intended)
+                {
+                    s.intended = intended;
+                    s.written = 0;
+                    s.busy = true;
+                    busy++;
+                    send(s);
+                };
+
+                auto complete = [&](session& s, bool failed)
+                {
+                    s.busy = false;
+                    busy--;
+
+                    if (failed)
+                    {
+                        errors_++;
+                    }
+
+                    if (failed || s.close || !opts_.keep_alive)
+                    {
+                        reopen(s);
+                    }
+
+                    const clock::time_point now = clock::now();
+
+                    // Queued requests keep their scheduled time, waiting for a connection counts
+                    if (!backlog_.empty())
+                    {
+                        const clock::time_point intended = backlog_.front();
+                        backlog_.pop_front();
+                        issue(s, intended);
+                    }
+                    else if (interval_ == clock::duration::zero() && now < end)
+                    {
+                        issue(s, now);
+                    }
+                    else
+                    {
+                        idle_.push_back(&s);
+                    }
+                };
+
+                auto handler = [&](ha::epoll_state state, const ha::socket& sock, void* data)
+                {
+                    session& s = *static_cast<session*>(data);
+
+                    if (state == ha::epoll_state::EPOLL_WRITE)
+                    {
+                        send(s);
+                        return;
+                    }
+
+                    bool closed = false;
+                    bytes_ += sock.read_into(s.input, closed);
+
+                    if (!s.busy)
+                    {
+                        // Nothing asked: the server closed an idle keep-alive connection
+                        s.input.clear();
+                        reopen(s);
+                        return;
+                    }
+
+                    response_head head;
+                    if (parse_head(s.input.data(), s.input.size(), head) &&
+                        s.input.size() >= head.length + head.content_length)
+                    {
+                        const clock::time_point now = clock::now();
+
+                        latencies_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                now - s.intended).count());
+                        completed_++;
+
+                        s.input.consume(head.length + head.content_length);
+                        s.close = head.close || closed;
+                        complete(s, head.status < 200 || head.status >= 400);
+                    }
+                    else if (closed || state == ha::epoll_state::EPOLL_CLOSE ||
+                             state == ha::epoll_state::EPOLL_ERROR)
+                    {
+                        complete(s, true);
+                    }
+                };
+
+                if (interval_ == clock::duration::zero())
+                {
+                    while (!idle_.empty())
+                    {
+                        session* s = idle_.back();
+                        idle_.pop_back();
+                        issue(*s, clock::now());
+                    }
+                }
+
+                while (true)
+                {
+                    clock::time_point now = clock::now();
+
+                    if (interval_ != clock::duration::zero())
+                    {
+                        while (next <= now && next < end)
+                        {
+                            if (!idle_.empty())
+                            {
+                                session* s = idle_.back();
+                                idle_.pop_back();
+                                issue(*s, next);
+                            }
+                            else
+                            {
+                                backlog_.push_back(next);
+                            }
+
+                            next += interval_;
+                        }
+                    }
+
+                    if ((now >= end && !busy && backlog_.empty()) || now >= grace)
+                    {
+                        break;
+                    }
+
+                    // Wake for the next scheduled request, epoll_wait() counts whole milliseconds
+                    clock::time_point wake = now < end && interval_ != clock::duration::zero() ?
+                        std::min(next, end) : std::min(grace, now + std::chrono::milliseconds(100));
+                    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count();
+
+                    ep_.wait(std::max<long long>(1, ms));
+                    ep_.dispatch(handler);
+                }
+
+                unfinished_ = busy + backlog_.size();
+            }
+
+            const ha::histogram& latencies() const { return latencies_; }
+            uint64_t completed() const { return completed_; }
+            uint64_t errors() const { return errors_; }
+            uint64_t unfinished() const { return unfinished_; }
+            uint64_t bytes() const { return bytes_; }
+
+        private:
+            struct session
+            {
+                ha::client client;
+                ha::buffer input;
+                size_t written;
+                clock::time_point intended;
+                bool busy;
+                bool close;
+
+                session() : client(), input(), written(0), intended(), busy(false), close(false) { }
+            };
+
+            void open(session& s)
+            {
+                s.client.connect(opts_.target);
+                s.client.sock().nonblocking();
+
+                int nodelay = 1;
+                ::setsockopt(s.client.sock(), IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+                ep_.add_socket(s.client.sock(), &s, false);
+                s.close = false;
+            }
+
+            void reopen(session& s)
+            {
+                ep_.remove_socket(s.client.sock());
+                s.client.disconnect();
+                s.input.clear();
+                open(s);
+            }
+
+            void send(session& s)
+            {
+                s.written += s.client.sock().write(
+                        reinterpret_cast<const unsigned char*>(request_.data()) + s.written,
+                        request_.size() - s.written);
+
+                ep_.want_write(s.client.sock(), s.written < request_.size());
+            }
+
+        private:
+            const options& opts_;
+            const size_t connections_;
+            const clock::duration interval_;
+            std::string request_;
+            ha::epoll ep_;
+            std::vector<std::unique_ptr<session>> sessions_;
+            std::vector<session*> idle_;
+            std::deque<clock::time_point> backlog_;
+            ha::histogram latencies_;
+            uint64_t completed_;
+            uint64_t errors_;
+            uint64_t unfinished_;
+            uint64_t bytes_;
+    };
+}
+
+int main(int argc, char** argv)
+{
+    int rc = EXIT_SUCCESS;
+
+    options opts;
+    opts.target = "tcp:127.0.0.1:8080";
+    opts.path = "/";
+    opts.label = "";
+    opts.connections = 64;
+    opts.threads = 1;
+    opts.rate = 0;
+    opts.duration = 10;
+    opts.keep_alive = true;
+    opts.payload = 0;
+
+    int opt;
+    while ((opt = ::getopt(argc, argv, "c:t:r:d:kKs:l:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c': opts.connections = std::strtoul(optarg, 0, 10); break;
+            case 't': opts.threads = std::strtoul(optarg, 0, 10); break;
+            case 'r': opts.rate = std::atof(optarg); break;
+            case 'd': opts.duration = std::atof(optarg); break;
+            case 'k': opts.keep_alive = true; break;
+            case 'K': opts.keep_alive = false; break;
+            case 's': opts.payload = std::strtoul(optarg, 0, 10); break;
+            case 'l': opts.label = optarg; break;
+            default: usage(); return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc)
+    {
+        opts.target = argv[optind++];
+    }
+
+    if (optind < argc)
+    {
+        opts.path = argv[optind++];
+    }
+
+    opts.threads = std::max<size_t>(1, std::min(opts.threads, opts.connections));
+
+    if (!opts.connections || opts.duration <= 0)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        ::signal(SIGPIPE, SIG_IGN);
+
+        std::vector<std::unique_ptr<generator>> generators;
+        for (size_t i = 0; i < opts.threads; i++)
+        {
+            // Connections and rate split evenly, the first threads take the remainder
+            const size_t connections = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+            generators.push_back(std::unique_ptr<generator>(
+                    new generator(opts, connections, opts.rate * connections / opts.connections)));
+        }
+
+        const generator::clock::time_point start = generator::clock::now() + std::chrono::milliseconds(100);
+        const generator::clock::time_point end = start + std::chrono::duration_cast<generator::clock::duration>(
+                std::chrono::duration<double>(opts.duration));
+
+        std::mutex error_mutex;
+        std::string error;
+        std::vector<std::thread> threads;
+
+        for (auto& gen : generators)
+        {
+            threads.push_back(std::thread([&](generator* g)
+            {
+                try
+                {
+                    std::this_thread::sleep_until(start);
+                    g->run(start, end);
+                }
+                catch(std::exception& e)
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    error = e.what();
+                }
+            }, gen.get()));
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        if (!error.empty())
+        {
+            throw std::runtime_error(error);
+        }
+
+        ha::histogram latencies;
+        uint64_t completed = 0, errors = 0, unfinished = 0, bytes = 0;
+
+        for (auto& gen : generators)
+        {
+            latencies.merge(gen->latencies());
+            completed += gen->completed();
+            errors += gen->errors();
+            unfinished += gen->unfinished();
+            bytes += gen->bytes();
+        }
+
+        // Microseconds, nanosecond buckets are far finer than loopback jitter
+        std::cout << std::fixed << std::setprecision(1)
+                  << "{\"label\":\"" << opts.label << "\""
+                  << ",\"target\":\"" << opts.target << "\""
+                  << ",\"connections\":" << opts.connections
+                  << ",\"threads\":" << opts.threads
+                  << ",\"rate\":" << opts.rate
+                  << ",\"duration\":" << opts.duration
+                  << ",\"keep_alive\":" << (opts.keep_alive ? "true" : "false")
+                  << ",\"payload\":" << opts.payload
+                  << ",\"requests\":" << completed
+                  << ",\"errors\":" << errors
+                  << ",\"unfinished\":" << unfinished
+                  << ",\"bytes\":" << bytes
+                  << ",\"throughput\":" << completed / opts.duration
+                  << ",\"latency_us\":{"
+                  << "\"mean\":" << latencies.mean() / 1000
+                  << ",\"p50\":" << latencies.percentile(0.5) / 1000.0
+                  << ",\"p90\":" << latencies.percentile(0.9) / 1000.0
+                  << ",\"p99\":" << latencies.percentile(0.99) / 1000.0
+                  << ",\"p999\":" << latencies.percentile(0.999) / 1000.0
+                  << ",\"max\":" << latencies.max() / 1000.0
+                  << "}}" << std::endl;
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+
+        rc = EXIT_FAILURE;
+    }
+
+    return rc;
+}
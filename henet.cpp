@@ -5,6 +5,7 @@
  */
 
 #include <algorithm>
+#include <cmath>
 
 
 #include "henet.h"
@@ -12,839 +13,6393 @@
 namespace ha
 {
 
-socket::socket()
-    : socket_(-1)
+string_ref::string_ref()
+    : data_(""),
+      size_(0)
 {
 }
 
-socket::socket(int socket)
-    : socket_(socket)
+string_ref::string_ref(const char* data, size_t size)
+    : data_(data),
+      size_(size)
 {
 }
 
-socket::socket(int domain, int type, int protocol)
-    : socket_(::socket(domain, type, protocol))
+string_ref::string_ref(const char* str)
+    : data_(str),
+      size_(::strlen(str))
 {
-    if (socket_ < 0)
-    {
-        throw std::runtime_error("Invalid socket.");
-    }
 }
 
-socket::socket(const socket& other)
-    : socket_(-1)
+string_ref::string_ref(const std::string& str)
+    : data_(str.data()),
+      size_(str.size())
 {
-    // Call assignment operator
-    *this = other;
 }
 
-socket::socket(socket&& other)
-    : socket_(-1)
+const char* string_ref::data() const
 {
-    // Call move assignment operator
-    *this = std::move(other);
+    return data_;
 }
 
-socket::~socket()
+size_t string_ref::size() const
 {
-    close();
+    return size_;
 }
 
-std::vector<unsigned char> socket::read() const
+bool string_ref::empty() const
 {
-    const ssize_t buff_size = 8192;
-    std::vector<unsigned char> buffer(buff_size);
-    ssize_t total_read = 0L;
-    ssize_t read = 0L;
+    return size_ == 0;
+}
 
-    do
-    {
-        read = ::read(socket_, &buffer[total_read], buff_size);
+std::string string_ref::str() const
+{
+    return std::string(data_, size_);
+}
 
-        if(read > 0)
-        {
-            total_read += read;
+bool string_ref::equals(const string_ref& other) const
+{
+    return size_ == other.size_ && ::memcmp(data_, other.data_, size_) == 0;
+}
 
-            if (read >= buff_size)
-            {
-                buffer.resize(buff_size);
-            }
-            else
-            {
-                break;
-            }
-        }
-        else
-        {
-            break;
-        }
-    }
-    while (read > 0);
+bool string_ref::iequals(const string_ref& other) const
+{
+    return size_ == other.size_ && ::strncasecmp(data_, other.data_, size_) == 0;
+}
 
-    if (read < 0)
+bool string_ref::icontains(const string_ref& token) const
+{
+    for (size_t i = 0; token.size_ <= size_ && i <= size_ - token.size_; i++)
     {
-        if (!util::is_ignored_error(errno))
+        if (::strncasecmp(data_ + i, token.data_, token.size_) == 0)
         {
-            throw std::runtime_error(std::string("read() exception: ") + ::strerror(errno));
+            return true;
         }
     }
 
-    buffer.resize(total_read);
-
-    return buffer;
+    return false;
 }
 
-size_t socket::write(const unsigned char* buffer, size_t size) const
-{
-    size_t rc = 0;
+const size_t block_pool::block_min_hint;
+const size_t block_pool::block_classes_hint;
+const size_t block_pool::block_cache_hint;
 
-    if (buffer && size > 0)
+block_pool::block_pool(size_t cached)
+    : cached_(cached),
+      free_(block_classes_hint),
+      allocations_(0)
+{
+    // Free lists never grow past their reservation, releasing a block does not allocate
+    for (auto& blocks : free_)
     {
-        ssize_t write_total = size;
-        ssize_t write_remaining = 0L;
-        ssize_t written_total = 0L;
-        ssize_t written = 0L;
-
-        do
-        {
-            written = ::write(socket_, &buffer[write_remaining], write_total);
-
-            if(written > 0)
-            {
-                written_total += written;
-
-                if(written < write_total)
-                {
-                    write_total -= written;
-                    write_remaining += written;
-                }
-                else
-                {
-                    break;
-                }
-            }
-            else
-            {
-                break;
-            }
-        }
-        while (written > 0);
+        blocks.reserve(cached_);
+    }
+}
 
-        if (written < 0)
+block_pool::~block_pool()
+{
+    for (auto& blocks : free_)
+    {
+        for (unsigned char* block : blocks)
         {
-            if (!util::is_ignored_error(errno))
-            {
-                throw std::runtime_error(std::string("write() exception: ") + ::strerror(errno));
-            }
+            util::pool_free(block);
         }
-
-        rc = static_cast<size_t>(written_total);
     }
-
-    return rc;
 }
 
-size_t socket::write(const std::vector<unsigned char>& buffer) const
+unsigned char* block_pool::acquire(size_t size, size_t& capacity)
 {
-    return write(&buffer[0], buffer.size());
-}
+    const size_t index = size_class(size);
 
-size_t socket::write(const std::string& buffer) const
-{
-    return write(reinterpret_cast<const unsigned char*>(buffer.c_str()), buffer.length());
-}
+    if (index >= free_.size())
+    {
+        // Larger than any class: straight from the heap
+        capacity = size;
+        allocations_++;
 
-size_t socket::write_file(std::string filename) const
-{
-    size_t rc = 0;
+        return static_cast<unsigned char*>(util::pool_allocate(size));
+    }
 
-    try
-    {
-        // RAII technique to acquire/release file handle
-        scoped_resource<int, const char*, int> fd(::open, filename.c_str(), O_RDONLY, ::close);
+    capacity = block_min_hint << index;
 
-        if (fd == -1)
-        {
-            throw std::runtime_error(std::string("open() exception: ") + ::strerror(errno));
-        }
+    if (!free_[index].empty())
+    {
+        unsigned char* block = free_[index].back();
+        free_[index].pop_back();
 
-        struct stat sb;
-        int st = ::fstat(fd, &sb);
+        return block;
+    }
 
-        if (st == -1)
-        {
-            throw std::runtime_error(std::string("stat() exception: ") + ::strerror(errno));
-        }
+    allocations_++;
 
-        off_t foffset = 0;
-        size_t file_size = sb.st_size;
-        ssize_t written = ::sendfile(socket_, fd, &foffset, file_size);
+    return static_cast<unsigned char*>(util::pool_allocate(capacity));
+}
 
-        if (written < 0)
-        {
-            if (!util::is_ignored_error(errno))
-            {
-                throw std::runtime_error(std::string("sendfile() exception: ") + ::strerror(errno));
-            }
-        }
+void block_pool::release(unsigned char* block, size_t capacity)
+{
+    const size_t index = size_class(capacity);
 
-        rc = static_cast<size_t>(written);
+    if (index < free_.size() && capacity == (block_min_hint << index) && free_[index].size() < cached_)
+    {
+        free_[index].push_back(block);
     }
-    catch(std::exception& e)
+    else
     {
-        throw;
+        util::pool_free(block);
     }
-
-    return rc;
 }
 
-void socket::reuse() const
+size_t block_pool::allocations() const
 {
-    if (socket_ >= 0)
-    {
-        int reuse = 1;
-        int rc = ::setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
-        if ( rc < 0 )
-        {
-            throw std::runtime_error(
-                    std::string("socket::reuse()exception: Setting socket options SO_REUSEADDR failed: ") +
-                    + ::strerror(errno));
-        }
-    }
+    return allocations_;
 }
 
-void socket::nonblocking() const
+size_t block_pool::size_class(size_t size)
 {
-    if (socket_ >= 0)
+    size_t index = 0;
+
+    while ((block_min_hint << index) < size && index < block_classes_hint)
     {
-        int flags = ::fcntl(socket_, F_GETFL, 0);
+        index++;
+    }
 
-        if (flags == -1)
-        {
-            throw std::runtime_error(std::string("fcntl() exception: ") + ::strerror(errno));
-        }
+    return index;
+}
 
-        flags |= O_NONBLOCK;
-        int rc = ::fcntl(socket_, F_SETFL, flags);
+const size_t buffer::buffer_size_hint;
 
-        if (rc == -1)
-        {
-            throw std::runtime_error(std::string("fcntl() exception: ") + ::strerror(errno));
-        }
-    }
+buffer::buffer()
+    : pool_(0),
+      storage_(0),
+      capacity_(0),
+      head_(0),
+      tail_(0)
+{
 }
 
-void socket::close()
+buffer::buffer(size_t capacity)
+    : pool_(0),
+      storage_(0),
+      capacity_(0),
+      head_(0),
+      tail_(0)
 {
-    if (socket_ >= 0)
-    {
-        ::close(socket_);
-        socket_ = -1;
-    }
+    reserve(capacity);
 }
 
-socket& socket::operator=(const socket& other)
+buffer::buffer(block_pool* pool)
+    : pool_(pool),
+      storage_(0),
+      capacity_(0),
+      head_(0),
+      tail_(0)
 {
-    if (this != &other)
-    {
-        socket_ = other.socket_;
-    }
+}
 
-    return *this;
+buffer::buffer(buffer&& other)
+    : pool_(other.pool_),
+      storage_(other.storage_),
+      capacity_(other.capacity_),
+      head_(other.head_),
+      tail_(other.tail_)
+{
+    other.storage_ = 0;
+    other.capacity_ = other.head_ = other.tail_ = 0;
 }
 
-socket& socket::operator=(socket&& other)
+buffer& buffer::operator=(buffer&& other)
 {
     if (this != &other)
     {
-        socket_ = other.socket_;
-        other.socket_ = -1;
-    }
+        release();
 
-    return *this;
-}
+        pool_ = other.pool_;
+        storage_ = other.storage_;
+        capacity_ = other.capacity_;
+        head_ = other.head_;
+        tail_ = other.tail_;
 
-int socket::operator=(int socket)
-{
-    socket_ = socket;
+        other.storage_ = 0;
+        other.capacity_ = other.head_ = other.tail_ = 0;
+    }
 
-    return socket_;
+    return *this;
 }
 
-socket::operator const int() const
+buffer::~buffer()
 {
-    return socket_;
+    release();
 }
 
-socket::operator const int*() const
+const unsigned char* buffer::data() const
 {
-    return &socket_;
+    return storage_ + head_;
 }
 
-address::address()
-    : sockaddr_({0})
+size_t buffer::size() const
 {
+    return tail_ - head_;
 }
 
-address::address(sockaddr saddr)
-    : sockaddr_(saddr)
+bool buffer::empty() const
 {
+    return tail_ == head_;
 }
 
-address::address(short family, in_addr addr, unsigned short port)
-    : sockaddr_({0})
+size_t buffer::capacity() const
 {
-    sockaddr_in* paddr = ((sockaddr_in*)&sockaddr_);
-    paddr->sin_family = family;
-    paddr->sin_addr = addr;
-    paddr->sin_port = htons(port);
+    return capacity_;
 }
 
-address::address(std::string addr, unsigned short port)
-    : sockaddr_({0})
+unsigned char* buffer::prepare(size_t n)
 {
-    sockaddr_in saddr;
-
-    int rc = ::inet_pton(AF_INET, addr.c_str(), &saddr.sin_addr);
-
-    if (rc > 0)
-    {
-        sockaddr_in* paddr = ((sockaddr_in*)&sockaddr_);
-        paddr->sin_family = saddr.sin_family;
-        paddr->sin_addr = saddr.sin_addr;
-        paddr->sin_port = htons(port);
-    }
-    else
+    if (capacity_ - tail_ < n)
     {
-        if (rc == 0)
+        if (head_ > 0)
         {
-            throw std::runtime_error(std::string("inet_pton() exception: ") + "Network address is not valid.");
+            ::memmove(storage_, storage_ + head_, tail_ - head_);
+            tail_ -= head_;
+            head_ = 0;
         }
-        else
+
+        if (capacity_ - tail_ < n)
         {
-            throw std::runtime_error(std::string("inet_pton() exception: ") + ::strerror(errno));
+            reserve(std::max(std::max(capacity_ * 2, tail_ + n), buffer_size_hint));
         }
     }
-}
 
-address::address(const address& other)
-    : sockaddr_({0})
-{
-    // Call assignment operator
-    *this = other;
+    return storage_ + tail_;
 }
 
-address::address(address&& other)
-    : sockaddr_({0})
+size_t buffer::writable() const
 {
-    // Call move assignment operator
-    *this = std::move(other);
+    return capacity_ - tail_;
 }
 
-address::~address()
+void buffer::commit(size_t n)
 {
-    ::memset(&sockaddr_, 0, sizeof(sockaddr));
+    tail_ += std::min(n, writable());
 }
 
-address& address::operator=(const address& other)
+void buffer::consume(size_t n)
 {
-    if (this != &other)
+    head_ += std::min(n, size());
+
+    if (head_ == tail_)
     {
-        sockaddr_ = other.sockaddr_;
+        head_ = tail_ = 0;
     }
+}
 
-    return *this;
+void buffer::clear()
+{
+    head_ = tail_ = 0;
 }
 
-address& address::operator=(address&& other)
+void buffer::reserve(size_t capacity)
 {
-    if (this != &other)
+    if (capacity <= capacity_)
     {
-        sockaddr_ = other.sockaddr_;
-        ::memset(&other.sockaddr_, 0, sizeof(sockaddr));
+        return;
     }
 
-    return *this;
+    size_t granted = capacity;
+    unsigned char* storage = pool_ ? pool_->acquire(capacity, granted)
+                                   : static_cast<unsigned char*>(util::pool_allocate(capacity));
+
+    if (tail_ > head_)
+    {
+        ::memcpy(storage, storage_ + head_, tail_ - head_);
+    }
+
+    tail_ -= head_;
+    head_ = 0;
+
+    release();
+
+    storage_ = storage;
+    capacity_ = granted;
 }
 
-std::string address::str() const
+void buffer::release()
 {
-    const sockaddr_in* sa = operator const sockaddr_in*();
-    char str[INET_ADDRSTRLEN] = {0};
-    const char* rc = ::inet_ntop(sa->sin_family, &sa->sin_addr.s_addr, str, INET_ADDRSTRLEN);
-
-    /*if (rc == 0)
+    if (storage_)
     {
-        throw std::runtime_error(::strerror(errno));
-    }*/
+        if (pool_)
+        {
+            pool_->release(storage_, capacity_);
+        }
+        else
+        {
+            util::pool_free(storage_);
+        }
 
-    return std::string(rc == 0 ? "<unknow address>" : str);
+        storage_ = 0;
+        capacity_ = 0;
+    }
 }
 
-socklen_t address::size() const
+slice::slice()
+    : data_(0),
+      size_(0)
 {
-    return sizeof(sockaddr_);
 }
 
-address::operator const sockaddr() const
+slice::slice(const void* data, size_t size)
+    : data_(static_cast<const unsigned char*>(data)),
+      size_(size)
 {
-    return sockaddr_;
 }
 
-address::operator const sockaddr*() const
+slice::slice(const std::string& str)
+    : data_(reinterpret_cast<const unsigned char*>(str.data())),
+      size_(str.size())
 {
-    return &sockaddr_;
 }
 
-address::operator const sockaddr_in() const
+slice::slice(const std::vector<unsigned char>& vec)
+    : data_(vec.data()),
+      size_(vec.size())
 {
-    return (*((sockaddr_in*)&sockaddr_));
 }
 
-address::operator const sockaddr_in*() const
+slice::slice(const buffer& buf)
+    : data_(buf.data()),
+      size_(buf.size())
 {
-    return ((sockaddr_in*)&sockaddr_);
 }
 
-mutex::mutex()
+const unsigned char* slice::data() const
 {
-    int rc = ::pthread_mutex_init(&mutex_, 0);
-
-    if (rc)
-    {
-        throw std::runtime_error("mutex::mutex() error.");
-    }
+    return data_;
 }
 
-mutex::~mutex()
+size_t slice::size() const
 {
-    int rc;
+    return size_;
+}
 
-    do
-    {
-        rc = ::pthread_mutex_destroy(&mutex_);
+const size_t socket::descriptors_hint;
+const size_t socket::read_budget_hint;
+
+socket::socket()
+    : socket_(-1)
+{
+}
+
+socket::socket(int socket)
+    : socket_(socket)
+{
+}
+
+socket::socket(int domain, int type, int protocol)
+    : socket_(::socket(domain, type, protocol))
+{
+    if (socket_ < 0)
+    {
+        throw std::runtime_error("Invalid socket.");
+    }
+}
+
+socket::socket(const socket& other)
+    : socket_(-1)
+{
+    // Call assignment operator
+    *this = other;
+}
+
+socket::socket(socket&& other) noexcept
+    : socket_(-1)
+{
+    // Call move assignment operator
+    *this = std::move(other);
+}
+
+socket::~socket()
+{
+    close();
+}
+
+std::vector<unsigned char> socket::read() const
+{
+    buffer buf;
+    read_into(buf);
+
+    return std::vector<unsigned char>(buf.data(), buf.data() + buf.size());
+}
+
+size_t socket::read_into(buffer& buf) const
+{
+    bool closed = false;
+
+    return read_into(buf, closed);
+}
+
+size_t socket::read_into(buffer& buf, bool& closed, size_t budget) const
+{
+    const size_t read_min = 1024;
+    size_t total_read = 0;
+    int flags = 0;
+
+    closed = false;
+
+    while (total_read < budget)
+    {
+        unsigned char* dst = buf.prepare(std::min(read_min, budget - total_read));
+        const size_t room = std::min(buf.writable(), budget - total_read);
+        ssize_t read = ::recv(socket_, dst, room, flags);
+
+        if (read > 0)
+        {
+            buf.commit(read);
+            total_read += read;
+
+            // First read may block, the rest only drain what is already queued
+            flags = MSG_DONTWAIT;
+        }
+        else if (read == 0)
+        {
+            closed = true;
+            break;
+        }
+        else
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (reactor_metrics* shard = reactor_metrics::current())
+                {
+                    shard->count(metric::METRIC_EAGAINS);
+                }
+
+                break;
+            }
+
+            if (!util::is_ignored_error(errno))
+            {
+                throw std::runtime_error(std::string("read() exception: ") + ::strerror(errno));
+            }
+
+            closed = true;
+            break;
+        }
+    }
+
+    return total_read;
+}
+
+size_t socket::write(const unsigned char* buffer, size_t size) const
+{
+    size_t rc = 0;
+
+    if (buffer && size > 0)
+    {
+        ssize_t write_total = size;
+        ssize_t write_remaining = 0L;
+        ssize_t written_total = 0L;
+        ssize_t written = 0L;
+
+        do
+        {
+            written = ::write(socket_, &buffer[write_remaining], write_total);
+
+            if(written > 0)
+            {
+                written_total += written;
+
+                if(written < write_total)
+                {
+                    write_total -= written;
+                    write_remaining += written;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            else
+            {
+                break;
+            }
+        }
+        while (written > 0);
+
+        if (written < 0)
+        {
+            if (!util::is_ignored_error(errno))
+            {
+                throw std::runtime_error(std::string("write() exception: ") + ::strerror(errno));
+            }
+        }
+
+        rc = static_cast<size_t>(written_total);
+    }
+
+    return rc;
+}
+
+size_t socket::write(const std::vector<unsigned char>& buffer) const
+{
+    return write(&buffer[0], buffer.size());
+}
+
+size_t socket::write(const std::string& buffer) const
+{
+    return write(reinterpret_cast<const unsigned char*>(buffer.c_str()), buffer.length());
+}
+
+size_t socket::writev(const slice* slices, size_t count, bool more) const
+{
+    const size_t iov_batch = 64;
+    struct iovec iov[iov_batch];
+    const int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+
+    size_t written_total = 0;
+    size_t index = 0;
+    size_t offset = 0;
+
+    while (index < count)
+    {
+        // Refill the iovec window from the first unsent byte
+        size_t iov_count = 0;
+        size_t offered = 0;
+        for (size_t i = index; i < count && iov_count < iov_batch; i++)
+        {
+            const size_t skip = i == index ? offset : 0;
+
+            if (slices[i].size() > skip)
+            {
+                iov[iov_count].iov_base = const_cast<unsigned char*>(slices[i].data()) + skip;
+                iov[iov_count].iov_len = slices[i].size() - skip;
+                offered += iov[iov_count].iov_len;
+                iov_count++;
+            }
+        }
+
+        if (iov_count == 0)
+        {
+            break;
+        }
+
+        struct msghdr msg = { 0 };
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+
+        ssize_t written = ::sendmsg(socket_, &msg, flags);
+        reactor_metrics* shard = reactor_metrics::current();
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (!util::is_ignored_error(errno))
+            {
+                throw std::runtime_error(std::string("sendmsg() exception: ") + ::strerror(errno));
+            }
+
+            if (shard && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                shard->count(metric::METRIC_EAGAINS);
+            }
+
+            break;
+        }
+
+        if (shard && static_cast<size_t>(written) < offered)
+        {
+            shard->count(metric::METRIC_SHORT_WRITES);
+        }
+
+        written_total += written;
+
+        // Advance past fully sent slices, remember the offset into a partial one
+        size_t advance = static_cast<size_t>(written);
+        while (index < count && advance >= slices[index].size() - offset)
+        {
+            advance -= slices[index].size() - offset;
+            offset = 0;
+            index++;
+        }
+
+        offset += advance;
+    }
+
+    return written_total;
+}
+
+size_t socket::writev(const std::vector<slice>& slices, bool more) const
+{
+    return writev(slices.data(), slices.size(), more);
+}
+
+size_t socket::writev(std::initializer_list<slice> slices, bool more) const
+{
+    return writev(slices.begin(), slices.size(), more);
+}
+
+size_t socket::write_file(std::string filename) const
+{
+    size_t rc = 0;
+
+    try
+    {
+        // RAII technique to acquire/release file handle
+        scoped_resource<int, const char*, int> fd(::open, filename.c_str(), O_RDONLY | O_CLOEXEC, ::close);
+
+        if (fd == -1)
+        {
+            throw std::runtime_error(std::string("open() exception: ") + ::strerror(errno));
+        }
+
+        struct stat sb;
+        int st = ::fstat(fd, &sb);
+
+        if (st == -1)
+        {
+            throw std::runtime_error(std::string("stat() exception: ") + ::strerror(errno));
+        }
+
+        off_t foffset = 0;
+        rc = write_file(fd, foffset, sb.st_size);
+    }
+    catch(std::exception& e)
+    {
+        throw;
+    }
+
+    return rc;
+}
+
+size_t socket::write_file(int fd, off_t& offset, size_t count) const
+{
+    // Largest transfer Linux performs in a single sendfile() call
+    const size_t sendfile_max = 0x7ffff000;
+    size_t written_total = 0;
+
+    reactor_metrics* shard = reactor_metrics::current();
+
+    while (written_total < count)
+    {
+        const size_t offered = std::min(count - written_total, sendfile_max);
+        ssize_t written = ::sendfile(socket_, fd, &offset, offered);
+
+        if (written > 0)
+        {
+            written_total += written;
+
+            if (shard)
+            {
+                shard->count(metric::METRIC_SENDFILE_BYTES, written);
+
+                if (static_cast<size_t>(written) < offered)
+                {
+                    shard->count(metric::METRIC_SHORT_WRITES);
+                }
+            }
+        }
+        else if (written == 0)
+        {
+            // File is shorter than expected
+            break;
+        }
+        else
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (!util::is_ignored_error(errno))
+            {
+                throw std::runtime_error(std::string("sendfile() exception: ") + ::strerror(errno));
+            }
+
+            if (shard && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                shard->count(metric::METRIC_EAGAINS);
+            }
+
+            // EAGAIN: offset tells where to resume once the socket is writable again
+            break;
+        }
+    }
+
+    return written_total;
+}
+
+size_t socket::write_file(const cached_file& file, off_t& offset) const
+{
+    if (offset >= file.size())
+    {
+        return 0;
+    }
+
+    return write_file(file.fd(), offset, file.size() - offset);
+}
+
+size_t socket::send_descriptors(const slice& data, const int* fds, size_t count) const
+{
+    if (data.size() == 0)
+    {
+        throw std::runtime_error("Descriptors need data to travel with.");
+    }
+
+    struct iovec iov = { const_cast<unsigned char*>(data.data()), data.size() };
+    std::vector<char> control(count ? CMSG_SPACE(count * sizeof(int)) : 0);
+
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (count)
+    {
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        ::memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    }
+
+    ssize_t rc;
+    do
+    {
+        rc = ::sendmsg(socket_, &msg, MSG_NOSIGNAL);
+    }
+    while (rc < 0 && errno == EINTR);
+
+    if (rc < 0)
+    {
+        if (!util::is_ignored_error(errno))
+        {
+            throw std::runtime_error(std::string("sendmsg() exception: ") + ::strerror(errno));
+        }
+
+        return 0;
+    }
+
+    return static_cast<size_t>(rc);
+}
+
+size_t socket::send_descriptors(const slice& data, const std::vector<int>& fds) const
+{
+    return send_descriptors(data, fds.data(), fds.size());
+}
+
+size_t socket::receive_descriptors(unsigned char* data, size_t size, std::vector<socket>& fds, size_t max) const
+{
+    struct iovec iov = { data, size };
+    std::vector<char> control(CMSG_SPACE(std::max<size_t>(1, max) * sizeof(int)));
+
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    ssize_t rc;
+    do
+    {
+        rc = ::recvmsg(socket_, &msg, MSG_CMSG_CLOEXEC);
+    }
+    while (rc < 0 && errno == EINTR);
+
+    if (rc < 0)
+    {
+        if (!util::is_ignored_error(errno))
+        {
+            throw std::runtime_error(std::string("recvmsg() exception: ") + ::strerror(errno));
+        }
+
+        return 0;
+    }
+
+    // Descriptors beyond max were closed by the kernel (MSG_CTRUNC), the ones that fit are still ours
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                int fd;
+                ::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                fds.push_back(socket(fd));
+            }
+        }
+    }
+
+    return static_cast<size_t>(rc);
+}
+
+size_t socket::available() const
+{
+    int bytes = 0;
+
+    if (::ioctl(socket_, FIONREAD, &bytes) != 0)
+    {
+        return 0;
+    }
+
+    return static_cast<size_t>(bytes);
+}
+
+void socket::reuse() const
+{
+    if (socket_ >= 0)
+    {
+        int reuse = 1;
+        int rc = ::setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
+        if ( rc < 0 )
+        {
+            throw std::runtime_error(
+                    std::string("socket::reuse()exception: Setting socket options SO_REUSEADDR failed: ") +
+                    + ::strerror(errno));
+        }
+    }
+}
+
+void socket::reuse_port() const
+{
+    if (socket_ >= 0)
+    {
+        int reuse = 1;
+        int rc = ::setsockopt(socket_, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int));
+        if ( rc < 0 )
+        {
+            throw std::runtime_error(
+                    std::string("socket::reuse_port() exception: Setting socket options SO_REUSEPORT failed: ") +
+                    ::strerror(errno));
+        }
+    }
+}
+
+void socket::nonblocking() const
+{
+    if (socket_ >= 0)
+    {
+        int flags = ::fcntl(socket_, F_GETFL, 0);
+
+        if (flags == -1)
+        {
+            throw std::runtime_error(std::string("fcntl() exception: ") + ::strerror(errno));
+        }
+
+        flags |= O_NONBLOCK;
+        int rc = ::fcntl(socket_, F_SETFL, flags);
+
+        if (rc == -1)
+        {
+            throw std::runtime_error(std::string("fcntl() exception: ") + ::strerror(errno));
+        }
+    }
+}
+
+void socket::cork(bool enable) const
+{
+    if (socket_ >= 0)
+    {
+        // Uncorking flushes whatever partial segment is pending
+        int cork = enable ? 1 : 0;
+        int rc = ::setsockopt(socket_, IPPROTO_TCP, TCP_CORK, &cork, sizeof(int));
+        if ( rc < 0 )
+        {
+            throw std::runtime_error(
+                    std::string("socket::cork() exception: Setting socket options TCP_CORK failed: ") +
+                    ::strerror(errno));
+        }
+    }
+}
+
+void socket::close()
+{
+    if (socket_ >= 0)
+    {
+        ::close(socket_);
+        socket_ = -1;
+    }
+}
+
+void socket::abort()
+{
+    if (socket_ >= 0)
+    {
+        // Zero linger turns close() into a RST
+        linger lg = { 1, 0 };
+        ::setsockopt(socket_, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+
+    close();
+}
+
+int socket::release()
+{
+    int fd = socket_;
+    socket_ = -1;
+
+    return fd;
+}
+
+socket& socket::operator=(const socket& other)
+{
+    if (this != &other)
+    {
+        socket_ = other.socket_;
+    }
+
+    return *this;
+}
+
+socket& socket::operator=(socket&& other) noexcept
+{
+    if (this != &other)
+    {
+        socket_ = other.socket_;
+        other.socket_ = -1;
+    }
+
+    return *this;
+}
+
+int socket::operator=(int socket)
+{
+    socket_ = socket;
+
+    return socket_;
+}
+
+socket::operator const int() const
+{
+    return socket_;
+}
+
+socket::operator const int*() const
+{
+    return &socket_;
+}
+
+address::address()
+    : inline_(),
+      storage_(),
+      size_(0)
+{
+}
+
+address::address(const sockaddr* saddr, socklen_t size)
+    : inline_(),
+      storage_(),
+      size_(0)
+{
+    assign(saddr, size);
+}
+
+address::address(sockaddr saddr)
+    : inline_(),
+      storage_(),
+      size_(0)
+{
+    assign(&saddr, saddr.sa_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr));
+}
+
+address::address(short family, in_addr addr, unsigned short port)
+    : inline_(),
+      storage_(),
+      size_(sizeof(sockaddr_in))
+{
+    inline_.in.sin_family = family;
+    inline_.in.sin_addr = addr;
+    inline_.in.sin_port = htons(port);
+}
+
+address::address(const in6_addr& addr, unsigned short port)
+    : inline_(),
+      storage_(),
+      size_(sizeof(sockaddr_in6))
+{
+    inline_.in6.sin6_family = AF_INET6;
+    inline_.in6.sin6_addr = addr;
+    inline_.in6.sin6_port = htons(port);
+}
+
+address::address(std::string addr, unsigned short port)
+    : inline_(),
+      storage_(),
+      size_(0)
+{
+    int rc = ::inet_pton(AF_INET, addr.c_str(), &inline_.in.sin_addr);
+
+    if (rc > 0)
+    {
+        inline_.in.sin_family = AF_INET;
+        inline_.in.sin_port = htons(port);
+        size_ = sizeof(sockaddr_in);
+    }
+    else if (rc == 0 && (rc = ::inet_pton(AF_INET6, addr.c_str(), &inline_.in6.sin6_addr)) > 0)
+    {
+        inline_.in6.sin6_family = AF_INET6;
+        inline_.in6.sin6_port = htons(port);
+        size_ = sizeof(sockaddr_in6);
+    }
+    else
+    {
+        if (rc == 0)
+        {
+            throw std::runtime_error(std::string("inet_pton() exception: ") + "Network address is not valid.");
+        }
+        else
+        {
+            throw std::runtime_error(std::string("inet_pton() exception: ") + ::strerror(errno));
+        }
+    }
+}
+
+address::address(const address& other)
+    : inline_(),
+      storage_(),
+      size_(0)
+{
+    // Call assignment operator
+    *this = other;
+}
+
+address::address(address&& other) noexcept
+    : inline_(),
+      storage_(),
+      size_(0)
+{
+    // Call move assignment operator
+    *this = std::move(other);
+}
+
+address::~address()
+{
+}
+
+address address::local(const std::string& path)
+{
+    sockaddr_un saddr;
+    ::memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+
+    if (path.empty() || path == "@" || path.size() >= sizeof(saddr.sun_path))
+    {
+        throw std::runtime_error("Invalid unix socket path.");
+    }
+
+    ::memcpy(saddr.sun_path, path.data(), path.size());
+
+    // Abstract: a leading zero byte instead of '@', the length alone ends the name
+    if (path[0] == '@')
+    {
+        saddr.sun_path[0] = '\0';
+        return address(reinterpret_cast<const sockaddr*>(&saddr), offsetof(sockaddr_un, sun_path) + path.size());
+    }
+
+    return address(reinterpret_cast<const sockaddr*>(&saddr), offsetof(sockaddr_un, sun_path) + path.size() + 1);
+}
+
+void address::assign(const sockaddr* saddr, socklen_t size)
+{
+    if (size > sizeof(sockaddr_storage))
+    {
+        throw std::runtime_error("Network address is too long.");
+    }
+
+    if (size <= sizeof(inline_))
+    {
+        storage_.reset();
+        ::memset(&inline_, 0, sizeof(inline_));
+        ::memcpy(&inline_, saddr, size);
+    }
+    else
+    {
+        if (!storage_)
+        {
+            storage_.reset(new sockaddr_storage);
+        }
+
+        ::memset(storage_.get(), 0, sizeof(sockaddr_storage));
+        ::memcpy(storage_.get(), saddr, size);
+        inline_.sa.sa_family = saddr->sa_family;
+    }
+
+    size_ = size;
+}
+
+address& address::operator=(const address& other)
+{
+    if (this != &other)
+    {
+        assign(other, other.size_);
+    }
+
+    return *this;
+}
+
+address& address::operator=(address&& other) noexcept
+{
+    if (this != &other)
+    {
+        inline_ = other.inline_;
+        storage_ = std::move(other.storage_);
+        size_ = other.size_;
+        other.size_ = 0;
+    }
+
+    return *this;
+}
+
+bool address::operator==(const address& other) const
+{
+    return size_ == other.size_ && ::memcmp(operator const sockaddr*(), other, size_) == 0;
+}
+
+bool address::operator!=(const address& other) const
+{
+    return !(*this == other);
+}
+
+int address::family() const
+{
+    return inline_.sa.sa_family;
+}
+
+unsigned short address::port() const
+{
+    switch (family())
+    {
+        case AF_INET:
+            return ntohs(inline_.in.sin_port);
+        case AF_INET6:
+            return ntohs(inline_.in6.sin6_port);
+        default:
+            return 0;
+    }
+}
+
+std::string address::str() const
+{
+    char str[INET6_ADDRSTRLEN] = {0};
+    const char* rc = 0;
+
+    switch (family())
+    {
+        case AF_INET:
+            rc = ::inet_ntop(AF_INET, &inline_.in.sin_addr, str, sizeof(str));
+            break;
+        case AF_INET6:
+            rc = ::inet_ntop(AF_INET6, &inline_.in6.sin6_addr, str, sizeof(str));
+            break;
+        case AF_UNIX:
+        {
+            const sockaddr_un* un = reinterpret_cast<const sockaddr_un*>(operator const sockaddr*());
+            const size_t length = size_ > offsetof(sockaddr_un, sun_path) ? size_ - offsetof(sockaddr_un, sun_path) : 0;
+
+            // Unnamed peers have no path, abstract names start with a zero byte
+            if (length == 0)
+            {
+                return std::string();
+            }
+            else if (un->sun_path[0] == '\0')
+            {
+                return "@" + std::string(un->sun_path + 1, length - 1);
+            }
+
+            return std::string(un->sun_path, ::strnlen(un->sun_path, length));
+        }
+    }
+
+    return std::string(rc == 0 ? "<unknow address>" : str);
+}
+
+socklen_t address::size() const
+{
+    return size_;
+}
+
+address::operator const sockaddr*() const
+{
+    return storage_ ? reinterpret_cast<const sockaddr*>(storage_.get()) : &inline_.sa;
+}
+
+mutex::mutex()
+{
+    int rc = ::pthread_mutex_init(&mutex_, 0);
+
+    if (rc)
+    {
+        throw std::runtime_error("mutex::mutex() error.");
+    }
+}
+
+mutex::~mutex()
+{
+    int rc;
+
+    do
+    {
+        rc = ::pthread_mutex_destroy(&mutex_);
+    }
+    while (rc == EINTR);
+}
+
+bool mutex::try_lock()
+{
+    int rc = 0;
+    do
+    {
+        rc = ::pthread_mutex_trylock(&mutex_);
+    }
+    while (rc == EINTR);
+
+    if(rc && (rc!=EBUSY))
+    {
+        throw std::runtime_error("mutex::try_lock error.");
+    }
+
+    return !rc;
+}
+
+void mutex::lock()
+{
+    int rc;
+
+    do
+    {
+        rc = ::pthread_mutex_lock(&mutex_);
+    }
+    while (rc == EINTR);
+
+    if(rc)
+    {
+        throw std::runtime_error("mutex::lock error.");
+    }
+}
+
+void mutex::unlock()
+{
+    int rc;
+
+    do
+    {
+        rc = ::pthread_mutex_unlock(&mutex_);
+    }
+    while (rc == EINTR);
+
+    if(rc)
+    {
+        throw std::runtime_error("mutex::unlock error.");
+    }
+}
+
+cached_file::cached_file(int fd, const struct stat& st)
+    : fd_(fd),
+      stat_(st)
+{
+}
+
+cached_file::~cached_file()
+{
+    if (fd_ >= 0)
+    {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+int cached_file::fd() const
+{
+    return fd_;
+}
+
+off_t cached_file::size() const
+{
+    return stat_.st_size;
+}
+
+const struct stat& cached_file::stat() const
+{
+    return stat_;
+}
+
+bool cached_file::same(const struct stat& st) const
+{
+    return st.st_ino == stat_.st_ino &&
+           st.st_dev == stat_.st_dev &&
+           st.st_size == stat_.st_size &&
+           st.st_mtim.tv_sec == stat_.st_mtim.tv_sec &&
+           st.st_mtim.tv_nsec == stat_.st_mtim.tv_nsec;
+}
+
+const size_t file_cache::file_cache_size_hint;
+
+file_cache::file_cache(size_t capacity, unsigned long revalidate_ms)
+    : capacity_(std::max<size_t>(1, capacity)),
+      revalidate_(revalidate_ms),
+      lru_(),
+      index_(),
+      mutex_()
+{
+    index_.reserve(capacity_);
+}
+
+file_cache::~file_cache()
+{
+}
+
+file_cache::file_t file_cache::get(const std::string& path)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = index_.find(path);
+    if (it != index_.end())
+    {
+        lru_t::iterator pos = it->second;
+        lru_.splice(lru_.begin(), lru_, pos);
+
+        if (now - pos->checked < revalidate_)
+        {
+            return pos->file;
+        }
+
+        // Revalidate by mtime at most once per interval
+        struct stat sb;
+        if (::stat(path.c_str(), &sb) == 0 && pos->file->same(sb))
+        {
+            pos->checked = now;
+            return pos->file;
+        }
+
+        lru_.erase(pos);
+        index_.erase(it);
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        throw std::runtime_error(std::string("open() exception: ") + ::strerror(errno));
+    }
+
+    struct stat sb;
+    if (::fstat(fd, &sb) == -1)
+    {
+        int ec = errno;
+        ::close(fd);
+        throw std::runtime_error(std::string("stat() exception: ") + ::strerror(ec));
+    }
+
+    node entry;
+    entry.path = path;
+    entry.file = std::make_shared<const cached_file>(fd, sb);
+    entry.checked = now;
+
+    lru_.push_front(std::move(entry));
+    index_[path] = lru_.begin();
+
+    while (lru_.size() > capacity_)
+    {
+        // Evicted files stay open while senders still hold them
+        index_.erase(lru_.back().path);
+        lru_.pop_back();
+    }
+
+    return lru_.front().file;
+}
+
+void file_cache::invalidate(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = index_.find(path);
+    if (it != index_.end())
+    {
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+}
+
+void file_cache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    index_.clear();
+    lru_.clear();
+}
+
+size_t file_cache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return lru_.size();
+}
+
+epoll::epoll(size_t max_events)
+    : epollfd_(-1),
+      ready_(0),
+      slab_(),
+      registrations_(),
+      retired_(),
+      registered_(0),
+      wait_events_(std::max<size_t>(1, max_events))
+{
+    epollfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+
+    if (epollfd_ < 0 )
+    {
+        throw std::runtime_error(std::string("epoll_create() exception: ") + ::strerror(errno));
+    }
+
+    registrations_.reserve(epoll_queue_size_hint);
+    retired_.reserve(epoll_queue_size_hint);
+}
+
+epoll::~epoll()
+{
+    if (epollfd_ >= 0)
+    {
+        ::close(epollfd_);
+        epollfd_ = -1;
+    }
+
+    for (registration* reg : registrations_)
+    {
+        slab_.destroy(reg);
+    }
+
+    for (registration* reg : retired_)
+    {
+        slab_.destroy(reg);
+    }
+}
+
+const epoll& epoll::add_socket(const socket& sock, void* data, bool want_write)
+{
+    const int fd = sock;
+
+    if (fd >= 0 && static_cast<size_t>(fd) < registrations_.size() && registrations_[fd])
+    {
+        throw std::runtime_error("epoll::add_socket() exception: Socket is already registered.");
+    }
+
+    registration* reg = slab_.make();
+    reg->fd = fd;
+    reg->data = data;
+    reg->events = EPOLLIN | EPOLLPRI | EPOLLET | EPOLLERR | EPOLLHUP | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+
+    struct epoll_event ev = { 0 };
+    ev.data.ptr = reg;
+    ev.events = reg->events;
+
+    int rc = ::epoll_ctl(epollfd_, EPOLL_CTL_ADD, fd, &ev);
+
+    if (rc != 0)
+    {
+        slab_.destroy(reg);
+        throw std::runtime_error(std::string("epoll_ctl() exception: ") + ::strerror(errno));
+    }
+
+    // Indexed by descriptor, the table only grows when a higher descriptor shows up
+    if (static_cast<size_t>(fd) >= registrations_.size())
+    {
+        registrations_.resize(fd + 1, 0);
+    }
+
+    registrations_[fd] = reg;
+    registered_++;
+
+    return *this;
+}
+
+const epoll& epoll::remove_socket(const socket& sock)
+{
+    struct epoll_event ev = { 0 };
+
+    int rc = ::epoll_ctl(epollfd_, EPOLL_CTL_DEL, sock, &ev);
+
+    if (rc != 0)
+    {
+        throw std::runtime_error(std::string("epoll_ctl() exception: ") + ::strerror(errno));
+    }
+
+    const int fd = sock;
+
+    if (fd >= 0 && static_cast<size_t>(fd) < registrations_.size() && registrations_[fd])
+    {
+        // Events for it may still be pending in this round, retire until the next wait()
+        registrations_[fd]->fd = -1;
+        retired_.push_back(registrations_[fd]);
+        registrations_[fd] = 0;
+        registered_--;
+    }
+
+    return *this;
+}
+
+const epoll& epoll::want_write(const socket& sock, bool enable)
+{
+    const int fd = sock;
+
+    if (fd < 0 || static_cast<size_t>(fd) >= registrations_.size() || !registrations_[fd])
+    {
+        throw std::runtime_error("epoll::want_write() exception: Socket is not registered.");
+    }
+
+    registration& reg = *registrations_[fd];
+    uint32_t events = enable ? (reg.events | EPOLLOUT) : (reg.events & ~EPOLLOUT);
+
+    if (events != reg.events)
+    {
+        struct epoll_event ev = { 0 };
+        ev.data.ptr = &reg;
+        ev.events = events;
+
+        int rc = ::epoll_ctl(epollfd_, EPOLL_CTL_MOD, sock, &ev);
+
+        if (rc != 0)
+        {
+            throw std::runtime_error(std::string("epoll_ctl() exception: ") + ::strerror(errno));
+        }
+
+        reg.events = events;
+    }
+
+    return *this;
+}
+
+const epoll& epoll::rearm(const socket& sock)
+{
+    const int fd = sock;
+
+    if (fd < 0 || static_cast<size_t>(fd) >= registrations_.size() || !registrations_[fd])
+    {
+        throw std::runtime_error("epoll::rearm() exception: Socket is not registered.");
+    }
+
+    registration& reg = *registrations_[fd];
+
+    struct epoll_event ev = { 0 };
+    ev.data.ptr = &reg;
+    ev.events = reg.events;
+
+    if (::epoll_ctl(epollfd_, EPOLL_CTL_MOD, sock, &ev) != 0)
+    {
+        throw std::runtime_error(std::string("epoll_ctl() exception: ") + ::strerror(errno));
+    }
+
+    return *this;
+}
+
+bool epoll::wait(unsigned long ms)
+{
+    ready_ = 0;
+
+    for (registration* reg : retired_)
+    {
+        slab_.destroy(reg);
+    }
+
+    retired_.clear();
+
+    if (registered_)
+    {
+        int erc = ::epoll_wait(epollfd_, &wait_events_[0], wait_events_.size(), ms ? ms : -1);
+
+        if (erc < 0)
+        {
+            if (errno != EINTR)
+            {
+                throw std::runtime_error(std::string("epoll_wait() exception: ") + ::strerror(errno));
+            }
+
+            erc = 0;
+        }
+
+        ready_ = static_cast<size_t>(erc);
+
+        if (reactor_metrics* shard = reactor_metrics::current())
+        {
+            shard->count(metric::METRIC_WAKEUPS);
+            shard->count(metric::METRIC_EVENTS, ready_);
+        }
+    }
+
+    return !!ready_;
+}
+
+size_t epoll::ready() const
+{
+    return ready_;
+}
+
+size_t epoll::dispatch(const std::function<void(epoll_state, const socket&)>& fn) const
+{
+    return dispatch<const std::function<void(epoll_state, const socket&)>&>(fn);
+}
+
+size_t epoll::dispatch(const std::function<void(epoll_state, const socket&, void*)>& fn) const
+{
+    return dispatch<const std::function<void(epoll_state, const socket&, void*)>&>(fn);
+}
+
+epoll_state epoll::state(uint32_t events)
+{
+    return
+        events & EPOLLERR    ? epoll_state::EPOLL_ERROR   :
+        events & EPOLLIN     ? epoll_state::EPOLL_READ    :
+        events & EPOLLPRI    ? epoll_state::EPOLL_READ    :
+        events & EPOLLRDNORM ? epoll_state::EPOLL_READ    :
+        events & EPOLLRDBAND ? epoll_state::EPOLL_READ    :
+        events & EPOLLOUT    ? epoll_state::EPOLL_WRITE   :
+        events & EPOLLWRNORM ? epoll_state::EPOLL_WRITE   :
+        events & EPOLLWRBAND ? epoll_state::EPOLL_WRITE   :
+        events & EPOLLHUP    ? epoll_state::EPOLL_CLOSE   :
+                               epoll_state::EPOLL_UNKNOWN;
+}
+
+uring::uring(unsigned entries)
+    : ringfd_(-1),
+      features_(0),
+      sq_ptr_(MAP_FAILED),
+      sq_size_(0),
+      cq_ptr_(MAP_FAILED),
+      cq_size_(0),
+      sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      sqes_size_(0),
+      sq_head_(0),
+      sq_tail_(0),
+      sq_array_(0),
+      sq_mask_(0),
+      sq_entries_(0),
+      sq_local_tail_(0),
+      sq_submitted_(0),
+      cq_head_(0),
+      cq_tail_(0),
+      cqes_(0),
+      cq_mask_(0)
+{
+    io_uring_params params;
+    ::memset(&params, 0, sizeof(params));
+
+    ringfd_ = ::syscall(__NR_io_uring_setup, entries, &params);
+
+    if (ringfd_ < 0)
+    {
+        throw std::runtime_error(std::string("io_uring_setup() exception: ") + ::strerror(errno));
+    }
+
+    features_ = params.features;
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    if (features_ & IORING_FEAT_SINGLE_MMAP)
+    {
+        sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+
+    sq_ptr_ = ::mmap(0, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd_, IORING_OFF_SQ_RING);
+    cq_ptr_ = features_ & IORING_FEAT_SINGLE_MMAP ? sq_ptr_ :
+        ::mmap(0, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd_, IORING_OFF_CQ_RING);
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(
+        ::mmap(0, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd_, IORING_OFF_SQES));
+
+    if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED || sqes_ == MAP_FAILED)
+    {
+        int ec = errno;
+        release();
+        throw std::runtime_error(std::string("io_uring mmap() exception: ") + ::strerror(ec));
+    }
+
+    unsigned char* sq = static_cast<unsigned char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_local_tail_ = sq_submitted_ = *sq_tail_;
+
+    unsigned char* cq = static_cast<unsigned char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+}
+
+uring::~uring()
+{
+    release();
+}
+
+void uring::release()
+{
+    if (sqes_ != MAP_FAILED)
+    {
+        ::munmap(sqes_, sqes_size_);
+        sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+    }
+
+    if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+    {
+        ::munmap(cq_ptr_, cq_size_);
+    }
+    cq_ptr_ = MAP_FAILED;
+
+    if (sq_ptr_ != MAP_FAILED)
+    {
+        ::munmap(sq_ptr_, sq_size_);
+        sq_ptr_ = MAP_FAILED;
+    }
+
+    if (ringfd_ >= 0)
+    {
+        ::close(ringfd_);
+        ringfd_ = -1;
+    }
+}
+
+void uring::accept(const socket& listener, int flags, uint64_t tag)
+{
+    io_uring_sqe* e = sqe(IORING_OP_ACCEPT, listener, tag);
+    e->accept_flags = flags;
+    e->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void uring::recv(const socket& sock, uint16_t group, uint64_t tag, bool multishot)
+{
+    io_uring_sqe* e = sqe(IORING_OP_RECV, sock, tag);
+    e->flags = IOSQE_BUFFER_SELECT;
+    e->buf_group = group;
+    e->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+}
+
+void uring::send(const socket& sock, const void* data, size_t size, int flags, uint64_t tag)
+{
+    io_uring_sqe* e = sqe(IORING_OP_SEND, sock, tag);
+    e->addr = reinterpret_cast<uint64_t>(data);
+    e->len = size;
+    e->msg_flags = flags;
+}
+
+void uring::splice(int fd_in, int64_t off_in, int fd_out, size_t size, uint64_t tag, unsigned sqe_flags)
+{
+    io_uring_sqe* e = sqe(IORING_OP_SPLICE, fd_out, tag);
+    e->splice_fd_in = fd_in;
+    e->splice_off_in = off_in;
+    e->off = static_cast<uint64_t>(-1);
+    e->len = size;
+    e->flags = sqe_flags;
+}
+
+void uring::poll(const socket& sock, unsigned events, uint64_t tag, unsigned sqe_flags)
+{
+    io_uring_sqe* e = sqe(IORING_OP_POLL_ADD, sock, tag);
+    e->poll32_events = events;
+    e->flags = sqe_flags;
+}
+
+void uring::close(int fd, uint64_t tag)
+{
+    sqe(IORING_OP_CLOSE, fd, tag);
+}
+
+void uring::cancel(uint64_t target, uint64_t tag)
+{
+    io_uring_sqe* e = sqe(IORING_OP_ASYNC_CANCEL, -1, tag);
+    e->addr = target;
+}
+
+void uring::provide_buffers(void* base, unsigned size, unsigned count, uint16_t group, uint16_t id, uint64_t tag)
+{
+    io_uring_sqe* e = sqe(IORING_OP_PROVIDE_BUFFERS, count, tag);
+    e->addr = reinterpret_cast<uint64_t>(base);
+    e->len = size;
+    e->off = id;
+    e->buf_group = group;
+}
+
+size_t uring::wait(unsigned long ms)
+{
+    submit();
+
+    unsigned pending = sq_local_tail_ - sq_submitted_;
+    unsigned ready = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - *cq_head_;
+    int rc = enter(pending, ready ? 0 : 1, ready ? 0 : IORING_ENTER_GETEVENTS, ms);
+
+    if (rc < 0)
+    {
+        if (errno != ETIME && errno != EINTR && errno != EBUSY)
+        {
+            throw std::runtime_error(std::string("io_uring_enter() exception: ") + ::strerror(errno));
+        }
+    }
+    else
+    {
+        sq_submitted_ += rc;
+    }
+
+    const size_t completions = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - *cq_head_;
+
+    if (reactor_metrics* shard = reactor_metrics::current())
+    {
+        shard->count(metric::METRIC_WAKEUPS);
+        shard->count(metric::METRIC_EVENTS, completions);
+    }
+
+    return completions;
+}
+
+size_t uring::dispatch(const std::function<void(const io_uring_cqe&)>& fn)
+{
+    return dispatch<const std::function<void(const io_uring_cqe&)>&>(fn);
+}
+
+io_uring_sqe* uring::sqe(uint8_t opcode, int fd, uint64_t tag)
+{
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+    {
+        // Ring is full: hand what we have to the kernel without waiting
+        submit();
+
+        int rc = enter(sq_local_tail_ - sq_submitted_, 0, 0, 0);
+        if (rc < 0)
+        {
+            throw std::runtime_error(std::string("io_uring_enter() exception: ") + ::strerror(errno));
+        }
+
+        sq_submitted_ += rc;
+    }
+
+    const unsigned index = sq_local_tail_ & sq_mask_;
+    io_uring_sqe* e = &sqes_[index];
+    ::memset(e, 0, sizeof(io_uring_sqe));
+
+    e->opcode = opcode;
+    e->fd = fd;
+    e->user_data = tag;
+
+    sq_array_[index] = index;
+    sq_local_tail_++;
+
+    return e;
+}
+
+int uring::enter(unsigned submit, unsigned complete, unsigned flags, unsigned long ms)
+{
+    if (ms && complete && (features_ & IORING_FEAT_EXT_ARG))
+    {
+        __kernel_timespec ts;
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000;
+
+        io_uring_getevents_arg arg;
+        ::memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+        return ::syscall(__NR_io_uring_enter, ringfd_, submit, complete, flags | IORING_ENTER_EXT_ARG,
+            &arg, sizeof(arg));
+    }
+
+    return ::syscall(__NR_io_uring_enter, ringfd_, submit, complete, flags, 0, 0);
+}
+
+void uring::submit()
+{
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+}
+
+namespace
+{
+    // Index of the pool worker running on this thread, npos elsewhere
+    thread_local size_t current_worker = std::string::npos;
+    thread_local const thread_pool* current_pool = 0;
+}
+
+thread_pool::thread_pool(size_t workers, size_t queue_bound)
+    : bound_(std::max<size_t>(1, queue_bound)),
+      queues_(),
+      workers_(),
+      reserved_(0),
+      queued_(0),
+      waiting_(0),
+      next_(0),
+      stop_(false)
+{
+    if (workers == 0)
+    {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (size_t i = 0; i < workers; i++)
+    {
+        queues_.push_back(std::unique_ptr<worker_queue>(new worker_queue()));
+    }
+
+    for (size_t i = 0; i < workers; i++)
+    {
+        workers_.push_back(std::thread(&thread_pool::run, this, i));
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+        stop_ = true;
+    }
+
+    work_cond_.notify_all();
+    space_cond_.notify_all();
+
+    for (auto& worker : workers_)
+    {
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+}
+
+bool thread_pool::try_submit(task_t task)
+{
+    if (!reserve())
+    {
+        return false;
+    }
+
+    push(std::move(task));
+
+    return true;
+}
+
+void thread_pool::submit(task_t task)
+{
+    while (!reserve())
+    {
+        std::unique_lock<std::mutex> lock(wait_mutex_);
+        waiting_++;
+        space_cond_.wait(lock, [this]() { return reserved_ < bound_ || stop_; });
+        waiting_--;
+
+        if (stop_)
+        {
+            throw std::runtime_error("thread_pool::submit() exception: Pool is stopped.");
+        }
+    }
+
+    push(std::move(task));
+}
+
+size_t thread_pool::size() const
+{
+    return workers_.size();
+}
+
+size_t thread_pool::pending() const
+{
+    return queued_;
+}
+
+bool thread_pool::reserve()
+{
+    size_t reserved = reserved_;
+
+    do
+    {
+        if (reserved >= bound_)
+        {
+            return false;
+        }
+    }
+    while (!reserved_.compare_exchange_weak(reserved, reserved + 1));
+
+    return true;
+}
+
+void thread_pool::push(task_t&& task)
+{
+    // Workers feed their own deque, outsiders spread round-robin
+    size_t index = current_pool == this ? current_worker : next_++ % queues_.size();
+    worker_queue& queue = *queues_[index];
+
+    // Counted before it is published, a thief popping it at once must not take queued_ below zero
+    {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+        queued_++;
+    }
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    catch(...)
+    {
+        queued_--;
+        throw;
+    }
+
+    work_cond_.notify_one();
+}
+
+bool thread_pool::pop(size_t index, task_t& task)
+{
+    const size_t count = queues_.size();
+    bool found = false;
+
+    // Own deque from the back (LIFO, cache-warm), victims from the front
+    for (size_t i = 0; i < count && !found; i++)
+    {
+        worker_queue& queue = *queues_[(index + i) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        if (!queue.tasks.empty())
+        {
+            if (i == 0)
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+
+            found = true;
+        }
+    }
+
+    if (found)
+    {
+        queued_--;
+
+        reserved_--;
+
+        // Every release may be the one a blocked submitter is waiting for
+        if (waiting_ > 0)
+        {
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            space_cond_.notify_one();
+        }
+    }
+
+    return found;
+}
+
+void thread_pool::run(size_t index)
+{
+    current_worker = index;
+    current_pool = this;
+
+    while (true)
+    {
+        task_t task;
+
+        if (pop(index, task))
+        {
+            try
+            {
+                task();
+            }
+            catch(std::exception& e)
+            {
+                std::cerr << "thread_pool task exception: " << e.what() << std::endl;
+            }
+
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(wait_mutex_);
+        work_cond_.wait(lock, [this]() { return queued_ > 0 || stop_; });
+
+        if (stop_ && queued_ == 0)
+        {
+            break;
+        }
+    }
+}
+
+const unsigned histogram::histogram_sub_bits_hint;
+const size_t histogram::histogram_buckets_hint;
+
+histogram::histogram()
+    : counts_(histogram_buckets_hint, 0),
+      count_(0),
+      sum_(0),
+      max_(0)
+{
+}
+
+void histogram::record(uint64_t value, uint64_t count)
+{
+    counts_[bucket(value)] += count;
+    count_ += count;
+    sum_ += value * count;
+    max_ = std::max(max_, value);
+}
+
+void histogram::merge(const histogram& other)
+{
+    for (size_t i = 0; i < counts_.size(); i++)
+    {
+        counts_[i] += other.counts_[i];
+    }
+
+    count_ += other.count_;
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+}
+
+uint64_t histogram::count() const
+{
+    return count_;
+}
+
+uint64_t histogram::max() const
+{
+    return max_;
+}
+
+double histogram::mean() const
+{
+    return count_ ? static_cast<double>(sum_) / count_ : 0.0;
+}
+
+uint64_t histogram::percentile(double q) const
+{
+    if (!count_)
+    {
+        return 0;
+    }
+
+    q = std::min(1.0, std::max(0.0, q));
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count_)));
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < counts_.size(); i++)
+    {
+        seen += counts_[i];
+
+        if (seen >= rank)
+        {
+            return std::min(bucket_max(i), max_);
+        }
+    }
+
+    return max_;
+}
+
+size_t histogram::bucket(uint64_t value)
+{
+    const uint64_t linear = 1ULL << histogram_sub_bits_hint;
+
+    if (value < linear)
+    {
+        return static_cast<size_t>(value);
+    }
+
+    // Octave from the top bit, then the next sub_bits bits pick the bucket inside it
+    const unsigned top = 63 - __builtin_clzll(value);
+    const unsigned shift = top - histogram_sub_bits_hint;
+
+    return ((shift + 1) << histogram_sub_bits_hint) + ((value >> shift) & (linear - 1));
+}
+
+uint64_t histogram::bucket_max(size_t bucket)
+{
+    const uint64_t linear = 1ULL << histogram_sub_bits_hint;
+    const size_t octave = bucket >> histogram_sub_bits_hint;
+    const uint64_t sub = bucket & (linear - 1);
+
+    if (octave == 0)
+    {
+        return sub;
+    }
+
+    const unsigned shift = octave - 1;
+
+    return ((linear + sub) << shift) + ((1ULL << shift) - 1);
+}
+
+thread_local reactor_metrics* reactor_metrics::current_ = nullptr;
+
+const size_t reactor_metrics::metric_count;
+const size_t reactor_metrics::latency_count;
+
+reactor_metrics::reactor_metrics()
+{
+    // std::atomic is left uninitialized by its default constructor
+    for (auto& counter : counters_)
+    {
+        counter.store(0, std::memory_order_relaxed);
+    }
+
+    for (size_t l = 0; l < latency_count; l++)
+    {
+        for (auto& bucket : buckets_[l])
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+
+        sums_[l].store(0, std::memory_order_relaxed);
+        maxes_[l].store(0, std::memory_order_relaxed);
+    }
+}
+
+reactor_metrics* reactor_metrics::current()
+{
+    return current_;
+}
+
+void reactor_metrics::count(metric m, uint64_t n)
+{
+    std::atomic<uint64_t>& counter = counters_[static_cast<size_t>(m)];
+
+    // Single writer: a plain load and store, no locked read-modify-write
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void reactor_metrics::record(latency l, std::chrono::steady_clock::duration elapsed)
+{
+    const size_t index = static_cast<size_t>(l);
+    const long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    const uint64_t value = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+
+    std::atomic<uint64_t>& bucket = buckets_[index][histogram::bucket(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sums_[index].store(sums_[index].load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+
+    if (value > maxes_[index].load(std::memory_order_relaxed))
+    {
+        maxes_[index].store(value, std::memory_order_relaxed);
+    }
+}
+
+void reactor_metrics::snapshot(metrics_snapshot& into) const
+{
+    for (size_t m = 0; m < metric_count; m++)
+    {
+        into.counters_[m] += counters_[m].load(std::memory_order_relaxed);
+    }
+
+    for (size_t l = 0; l < latency_count; l++)
+    {
+        histogram& h = into.latencies_[l];
+
+        // Count comes from the buckets themselves, a sample landing meanwhile stays consistent
+        for (size_t b = 0; b < histogram::histogram_buckets_hint; b++)
+        {
+            const uint64_t n = buckets_[l][b].load(std::memory_order_relaxed);
+
+            h.counts_[b] += n;
+            h.count_ += n;
+        }
+
+        h.sum_ += sums_[l].load(std::memory_order_relaxed);
+        h.max_ = std::max(h.max_, maxes_[l].load(std::memory_order_relaxed));
+    }
+}
+
+reactor_metrics::scope::scope(reactor_metrics* shard)
+    : previous_(current_)
+{
+    current_ = shard;
+}
+
+reactor_metrics::scope::~scope()
+{
+    current_ = previous_;
+}
+
+metrics_snapshot::metrics_snapshot()
+    : counters_(static_cast<size_t>(metric::METRIC_COUNT), 0),
+      latencies_(static_cast<size_t>(latency::LATENCY_COUNT))
+{
+}
+
+uint64_t metrics_snapshot::count(metric m) const
+{
+    return counters_[static_cast<size_t>(m)];
+}
+
+const histogram& metrics_snapshot::latencies(latency l) const
+{
+    return latencies_[static_cast<size_t>(l)];
+}
+
+double metrics_snapshot::events_per_wakeup() const
+{
+    const uint64_t wakeups = count(metric::METRIC_WAKEUPS);
+
+    return wakeups ? static_cast<double>(count(metric::METRIC_EVENTS)) / wakeups : 0.0;
+}
+
+std::string metrics_snapshot::str() const
+{
+    static const char* const counter_names[] =
+        { "accepts", "accept_drops", "eagains", "truncated", "short_writes", "sendfile_bytes", "wakeups", "events" };
+    static const char* const latency_names[] =
+        { "first_byte_ns", "request_ns", "write_ns" };
+
+    std::ostringstream stream;
+
+    for (size_t m = 0; m < counters_.size(); m++)
+    {
+        stream << counter_names[m] << " " << counters_[m] << "\n";
+    }
+
+    stream << "events_per_wakeup " << std::fixed << std::setprecision(2) << events_per_wakeup() << "\n";
+
+    for (size_t l = 0; l < latencies_.size(); l++)
+    {
+        const histogram& h = latencies_[l];
+
+        stream << latency_names[l] << " count " << h.count() << " mean " << std::setprecision(0) << h.mean()
+               << " p50 " << h.percentile(0.5) << " p99 " << h.percentile(0.99)
+               << " p999 " << h.percentile(0.999) << " max " << h.max() << "\n";
+    }
+
+    return stream.str();
+}
+
+cached_response::cached_response(std::string&& head, const file_cache::file_t& body)
+    : head_(std::move(head)),
+      body_(body)
+{
+}
+
+const std::string& cached_response::head() const
+{
+    return head_;
+}
+
+const file_cache::file_t& cached_response::body() const
+{
+    return body_;
+}
+
+size_t cached_response::size() const
+{
+    return head_.size() + (body_ ? body_->size() : 0);
+}
+
+response_cache::response_t response_cache::slot::load() const
+{
+    return std::atomic_load(&current_);
+}
+
+const size_t response_cache::response_inline_limit;
+
+response_cache::response_cache(unsigned long refresh_ms)
+    : slots_(),
+      mutex_(),
+      stop_(false),
+      stop_cond_(),
+      refresher_()
+{
+    if (refresh_ms)
+    {
+        refresher_ = std::thread([this, refresh_ms]()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            while (!stop_)
+            {
+                stop_cond_.wait_for(lock, std::chrono::milliseconds(refresh_ms));
+
+                if (!stop_)
+                {
+                    lock.unlock();
+                    refresh();
+                    lock.lock();
+                }
+            }
+        });
+    }
+}
+
+response_cache::~response_cache()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+
+    stop_cond_.notify_all();
+
+    if (refresher_.joinable())
+    {
+        refresher_.join();
+    }
+}
+
+response_cache::slot_t response_cache::add(const std::string& key, int status, const headers_t& headers,
+        const std::string& body, bool date)
+{
+    std::shared_ptr<slot> entry = std::make_shared<slot>();
+    entry->status_ = status;
+    entry->headers_ = headers;
+    entry->date_ = date;
+
+    if (body.size() <= response_inline_limit)
+    {
+        entry->body_ = body;
+    }
+    else
+    {
+        // Large bodies live in a sealed memfd and go out with sendfile()
+        int fd = ::memfd_create(key.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+        if (fd < 0)
+        {
+            throw std::runtime_error(std::string("memfd_create() exception: ") + ::strerror(errno));
+        }
+
+        struct stat sb;
+
+        try
+        {
+            for (size_t written = 0; written < body.size(); )
+            {
+                ssize_t rc = ::write(fd, body.data() + written, body.size() - written);
+
+                if (rc < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    throw std::runtime_error(std::string("write() exception: ") + ::strerror(errno));
+                }
+
+                written += rc;
+            }
+
+            if (::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+            {
+                throw std::runtime_error(std::string("fcntl() exception: ") + ::strerror(errno));
+            }
+
+            if (::fstat(fd, &sb) == -1)
+            {
+                throw std::runtime_error(std::string("stat() exception: ") + ::strerror(errno));
+            }
+        }
+        catch(std::exception& e)
+        {
+            ::close(fd);
+            throw;
+        }
+
+        entry->file_ = std::make_shared<const cached_file>(fd, sb);
+    }
+
+    return insert(key, std::move(entry));
+}
+
+response_cache::slot_t response_cache::add_file(const std::string& key, int status, const headers_t& headers,
+        const std::string& path, bool date)
+{
+    std::shared_ptr<slot> entry = std::make_shared<slot>();
+    entry->status_ = status;
+    entry->headers_ = headers;
+    entry->date_ = date;
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        throw std::runtime_error(std::string("open() exception: ") + ::strerror(errno));
+    }
+
+    struct stat sb;
+    if (::fstat(fd, &sb) == -1)
+    {
+        int ec = errno;
+        ::close(fd);
+        throw std::runtime_error(std::string("stat() exception: ") + ::strerror(ec));
+    }
+
+    entry->file_ = std::make_shared<const cached_file>(fd, sb);
+
+    if (static_cast<size_t>(sb.st_size) <= response_inline_limit)
+    {
+        // Small files are folded into the head so one write sends everything
+        entry->body_.resize(sb.st_size);
+
+        ssize_t rc = ::pread(fd, &entry->body_[0], sb.st_size, 0);
+        if (rc != sb.st_size)
+        {
+            throw std::runtime_error(std::string("pread() exception: ") + ::strerror(errno));
+        }
+
+        entry->file_.reset();
+    }
+
+    return insert(key, std::move(entry));
+}
+
+response_cache::slot_t response_cache::find(const std::string& key) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = slots_.find(key);
+
+    return it == slots_.end() ? slot_t() : it->second;
+}
+
+response_cache::response_t response_cache::get(const std::string& key) const
+{
+    slot_t entry = find(key);
+
+    return entry ? entry->load() : response_t();
+}
+
+void response_cache::refresh()
+{
+    std::vector<std::shared_ptr<slot>> dated;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (auto& entry : slots_)
+        {
+            if (entry.second->date_)
+            {
+                dated.push_back(entry.second);
+            }
+        }
+    }
+
+    const std::string date = http_date();
+
+    for (auto& entry : dated)
+    {
+        std::atomic_store(&entry->current_, render(*entry, date));
+    }
+}
+
+size_t response_cache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return slots_.size();
+}
+
+response_cache::slot_t response_cache::insert(const std::string& key, std::shared_ptr<slot>&& entry)
+{
+    entry->current_ = render(*entry, entry->date_ ? http_date() : std::string());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    slots_[key] = entry;
+
+    return entry;
+}
+
+response_cache::response_t response_cache::render(const slot& entry, const std::string& date)
+{
+    const char* reason =
+        entry.status_ == 200 ? "OK" :
+        entry.status_ == 201 ? "Created" :
+        entry.status_ == 204 ? "No Content" :
+        entry.status_ == 301 ? "Moved Permanently" :
+        entry.status_ == 302 ? "Found" :
+        entry.status_ == 304 ? "Not Modified" :
+        entry.status_ == 400 ? "Bad Request" :
+        entry.status_ == 403 ? "Forbidden" :
+        entry.status_ == 404 ? "Not Found" :
+        entry.status_ == 500 ? "Internal Server Error" :
+        entry.status_ == 503 ? "Service Unavailable" :
+                               "Unknown";
+
+    const size_t length = entry.file_ ? entry.file_->size() : entry.body_.size();
+
+    std::ostringstream stream;
+    stream << "HTTP/1.1 " << entry.status_ << " " << reason << "\r\n";
+
+    if (!date.empty())
+    {
+        stream << "Date: " << date << "\r\n";
+    }
+
+    for (const auto& header : entry.headers_)
+    {
+        stream << header.first << ": " << header.second << "\r\n";
+    }
+
+    stream << "Content-Length: " << length << "\r\n\r\n" << entry.body_;
+
+    return std::make_shared<const cached_response>(stream.str(), entry.file_);
+}
+
+std::string response_cache::http_date()
+{
+    char date[64] = {0};
+    time_t now = ::time(0);
+    struct tm tm;
+
+    ::gmtime_r(&now, &tm);
+    ::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    return date;
+}
+
+const size_t connection::low_watermark_hint;
+const size_t connection::high_watermark_hint;
+
+connection::connection(socket&& sock, address&& addr, epoll* poller, block_pool* pool)
+    : socket_(std::move(sock)),
+      address_(std::move(addr)),
+      poller_(poller),
+      input_(pool),
+      output_(pool),
+      sealed_(pool),
+      queue_(),
+      pending_(0),
+      low_watermark_(low_watermark_hint),
+      high_watermark_(high_watermark_hint),
+      congested_(false),
+      deferred_(false),
+      state_(),
+      closed_(false),
+      accepted_(),
+      queued_()
+{
+    if (reactor_metrics::current())
+    {
+        accepted_ = std::chrono::steady_clock::now();
+    }
+}
+
+connection::~connection()
+{
+}
+
+const socket& connection::sock() const
+{
+    return socket_;
+}
+
+const address& connection::addr() const
+{
+    return address_;
+}
+
+buffer& connection::input()
+{
+    return input_;
+}
+
+size_t connection::receive()
+{
+    // Completion engines fill input() themselves
+    if (deferred_)
+    {
+        return 0;
+    }
+
+    bool eof = false;
+    size_t rc = socket_.read_into(input_, eof);
+
+    received(rc);
+
+    if (eof)
+    {
+        close();
+    }
+    else if (rc >= socket::read_budget_hint && poller_)
+    {
+        // Edge-triggered: without another report the rest would wait for the peer's next write
+        poller_->rearm(socket_);
+    }
+
+    return rc;
+}
+
+size_t connection::send(const slice& data)
+{
+    return send({ data });
+}
+
+size_t connection::send(std::initializer_list<slice> data)
+{
+    size_t sent = 0;
+
+    // Nothing queued: try the socket first, keep only what it refuses
+    if (queue_.empty() && !deferred_)
+    {
+        sent = socket_.writev(data);
+    }
+
+    size_t skip = sent;
+    for (const slice& part : data)
+    {
+        if (skip >= part.size())
+        {
+            skip -= part.size();
+            continue;
+        }
+
+        enqueue(slice(part.data() + skip, part.size() - skip));
+        skip = 0;
+    }
+
+    arm();
+
+    return sent;
+}
+
+size_t connection::send_file(const file_cache::file_t& file, off_t offset, size_t count)
+{
+    size_t sent = 0;
+
+    if (queue_.empty() && !deferred_)
+    {
+        sent = socket_.write_file(file->fd(), offset, count);
+    }
+
+    if (sent < count)
+    {
+        queued();
+
+        segment seg;
+        seg.remaining = count - sent;
+        seg.offset = offset;
+        seg.file = file;
+        seg.data = 0;
+
+        queue_.push_back(std::move(seg));
+        pending_ += count - sent;
+    }
+
+    arm();
+
+    return sent;
+}
+
+size_t connection::send_file(const file_cache::file_t& file)
+{
+    return send_file(file, 0, file->size());
+}
+
+size_t connection::send(const std::shared_ptr<const cached_response>& response)
+{
+    const std::string& head = response->head();
+    const file_cache::file_t& body = response->body();
+    size_t sent = 0;
+
+    if (queue_.empty() && !deferred_)
+    {
+        sent = socket_.writev({ head }, !!body);
+    }
+
+    // Whatever the socket refused is queued by reference, never copied
+    if (sent < head.size())
+    {
+        enqueue(response, slice(head.data() + sent, head.size() - sent));
+    }
+
+    if (body)
+    {
+        sent += send_file(body);
+    }
+
+    arm();
+
+    return sent;
+}
+
+bool connection::flush()
+{
+    while (!queue_.empty() && !deferred_)
+    {
+        const segment& seg = queue_.front();
+        const size_t remaining = seg.remaining;
+        size_t sent = 0;
+
+        if (seg.file)
+        {
+            off_t offset = seg.offset;
+            sent = socket_.write_file(seg.file->fd(), offset, seg.remaining);
+        }
+        else
+        {
+            // Hold back a partial segment while a file range follows
+            sent = socket_.writev({ slice(bytes(seg), seg.remaining) }, queue_.size() > 1);
+        }
+
+        consumed(sent);
+
+        if (sent < remaining)
+        {
+            break;
+        }
+    }
+
+    arm();
+
+    return queue_.empty();
+}
+
+size_t connection::pending() const
+{
+    return pending_;
+}
+
+void connection::watermarks(size_t low, size_t high)
+{
+    low_watermark_ = std::min(low, high);
+    high_watermark_ = high;
+}
+
+bool connection::congested() const
+{
+    return pending_ >= high_watermark_;
+}
+
+bool connection::resumed()
+{
+    if (congested_ && pending_ <= low_watermark_)
+    {
+        congested_ = false;
+        return true;
+    }
+
+    return false;
+}
+
+void connection::close()
+{
+    closed_ = true;
+}
+
+bool connection::closed() const
+{
+    return closed_;
+}
+
+void connection::enqueue(const slice& data)
+{
+    queued();
+
+    if (queue_.empty() || queue_.back().file || queue_.back().data)
+    {
+        segment seg;
+        seg.remaining = 0;
+        seg.offset = 0;
+        seg.data = 0;
+
+        queue_.push_back(std::move(seg));
+    }
+
+    ::memcpy(output_.prepare(data.size()), data.data(), data.size());
+    output_.commit(data.size());
+
+    queue_.back().remaining += data.size();
+    pending_ += data.size();
+}
+
+void connection::enqueue(const std::shared_ptr<const void>& hold, const slice& data)
+{
+    queued();
+
+    segment seg;
+    seg.remaining = data.size();
+    seg.offset = 0;
+    seg.hold = hold;
+    seg.data = data.data();
+
+    queue_.push_back(std::move(seg));
+    pending_ += data.size();
+}
+
+const unsigned char* connection::bytes(const segment& seg) const
+{
+    return seg.data ? seg.data : output_.data();
+}
+
+void connection::seal()
+{
+    // Sealed segments are queued ahead of any in output_, so none is left once one of these is sent
+    if (!sealed_.empty() || output_.empty())
+    {
+        return;
+    }
+
+    std::swap(output_, sealed_);
+
+    const unsigned char* pos = sealed_.data();
+    for (size_t i = 0; i < queue_.size(); i++)
+    {
+        segment& seg = queue_[i];
+
+        if (!seg.file && !seg.data)
+        {
+            seg.data = pos;
+            pos += seg.remaining;
+        }
+    }
+}
+
+void connection::consumed(size_t n)
+{
+    while (n > 0 && !queue_.empty())
+    {
+        segment& seg = queue_.front();
+        const size_t step = std::min(n, seg.remaining);
+
+        if (seg.file)
+        {
+            seg.offset += step;
+        }
+        else if (seg.data)
+        {
+            if (!sealed_.empty() && seg.data == sealed_.data())
+            {
+                sealed_.consume(step);
+            }
+
+            seg.data += step;
+        }
+        else
+        {
+            output_.consume(step);
+        }
+
+        seg.remaining -= step;
+        pending_ -= step;
+        n -= step;
+
+        if (seg.remaining == 0)
+        {
+            queue_.pop_front();
+        }
+    }
+
+    if (!pending_ && queued_ != std::chrono::steady_clock::time_point())
+    {
+        if (reactor_metrics* shard = reactor_metrics::current())
+        {
+            shard->record(latency::LATENCY_WRITE, std::chrono::steady_clock::now() - queued_);
+        }
+
+        queued_ = std::chrono::steady_clock::time_point();
+    }
+}
+
+void connection::received(size_t n)
+{
+    if (n && accepted_ != std::chrono::steady_clock::time_point())
+    {
+        if (reactor_metrics* shard = reactor_metrics::current())
+        {
+            shard->record(latency::LATENCY_FIRST_BYTE, std::chrono::steady_clock::now() - accepted_);
+        }
+
+        accepted_ = std::chrono::steady_clock::time_point();
+    }
+}
+
+void connection::queued()
+{
+    // Starts the clock on the short write that left the queue non-empty
+    if (!pending_ && reactor_metrics::current())
+    {
+        queued_ = std::chrono::steady_clock::now();
+    }
+}
+
+void connection::arm()
+{
+    if (pending_ >= high_watermark_)
+    {
+        congested_ = true;
+    }
+
+    if (poller_)
+    {
+        poller_->want_write(socket_, !queue_.empty());
+    }
+}
+
+namespace
+{
+    // Header lines up to the blank line ending a head, shared by requests and responses
+    parse_state parse_headers(const char* pos, const char* end, size_t body_limit, std::vector<http_header>& headers,
+                              size_t& content_length, bool& has_length, bool& chunked, bool& keep_alive)
+    {
+        for (const char* eol = pos; pos + 2 <= end; pos = eol + 2)
+        {
+            eol = std::search(pos, end, "\r\n", "\r\n" + 2);
+
+            if (eol == pos)
+            {
+                break;
+            }
+
+            // No obsolete line folding
+            if (*pos == ' ' || *pos == '\t')
+            {
+                return parse_state::PARSE_ERROR;
+            }
+
+            const char* colon = std::find(pos, eol, ':');
+            if (colon == eol || colon == pos)
+            {
+                return parse_state::PARSE_ERROR;
+            }
+
+            const char* vb = colon + 1;
+            const char* ve = eol;
+            while (vb < ve && (*vb == ' ' || *vb == '\t')) vb++;
+            while (ve > vb && (ve[-1] == ' ' || ve[-1] == '\t')) ve--;
+
+            http_header h;
+            h.name = string_ref(pos, colon - pos);
+            h.value = string_ref(vb, ve - vb);
+            headers.push_back(h);
+
+            if (h.name.iequals("Content-Length"))
+            {
+                size_t length = 0;
+                if (h.value.empty())
+                {
+                    return parse_state::PARSE_ERROR;
+                }
+
+                for (size_t i = 0; i < h.value.size(); i++)
+                {
+                    const char c = h.value.data()[i];
+                    if (c < '0' || c > '9' || length > (std::numeric_limits<size_t>::max() - 9) / 10)
+                    {
+                        return parse_state::PARSE_ERROR;
+                    }
+
+                    length = length * 10 + (c - '0');
+                }
+
+                // Bounded well below SIZE_MAX, head plus body cannot wrap around either
+                if (length > body_limit)
+                {
+                    return parse_state::PARSE_ERROR;
+                }
+
+                // Repeated with another value the message could be framed two ways (RFC 7230, 3.3.3)
+                if (has_length && length != content_length)
+                {
+                    return parse_state::PARSE_ERROR;
+                }
+
+                content_length = length;
+                has_length = true;
+            }
+            else if (h.name.iequals("Transfer-Encoding"))
+            {
+                chunked = true;
+            }
+            else if (h.name.iequals("Connection"))
+            {
+                if (h.value.icontains("close"))
+                {
+                    keep_alive = false;
+                }
+                else if (h.value.icontains("keep-alive"))
+                {
+                    keep_alive = true;
+                }
+            }
+        }
+
+        // Either header could end the body, a peer picking the other one would read a smuggled message
+        if (has_length && chunked)
+        {
+            return parse_state::PARSE_ERROR;
+        }
+
+        return parse_state::PARSE_COMPLETE;
+    }
+}
+
+const size_t http_request::http_head_limit;
+const size_t http_request::http_body_limit;
+const size_t http_request::http_headers_hint;
+
+http_request::http_request()
+    : scanned_(0),
+      head_length_(0),
+      content_length_(0),
+      method_(),
+      target_(),
+      version_(0),
+      headers_(),
+      body_(),
+      keep_alive_(false)
+{
+    headers_.reserve(http_headers_hint);
+}
+
+parse_state http_request::parse(const unsigned char* data, size_t size)
+{
+    const char* text = reinterpret_cast<const char*>(data);
+
+    if (head_length_ == 0)
+    {
+        // Resume the search for the blank line where the previous call stopped
+        size_t from = scanned_ > 3 ? scanned_ - 3 : 0;
+        const char* end = 0;
+
+        for (size_t i = from; i + 3 < size; i++)
+        {
+            if (text[i] == '\r' && text[i + 1] == '\n' && text[i + 2] == '\r' && text[i + 3] == '\n')
+            {
+                end = text + i + 4;
+                break;
+            }
+        }
+
+        if (!end)
+        {
+            scanned_ = size;
+            return size > http_head_limit ? parse_state::PARSE_ERROR : parse_state::PARSE_INCOMPLETE;
+        }
+
+        head_length_ = end - text;
+
+        parse_state rc = parse_head(text, head_length_);
+        if (rc != parse_state::PARSE_COMPLETE)
+        {
+            return rc;
+        }
+    }
+    else if (size >= head_length_ + content_length_)
+    {
+        // The caller's buffer may have moved since the head was seen, rebind the views
+        parse_head(text, head_length_);
+    }
+
+    if (size < head_length_ + content_length_)
+    {
+        return parse_state::PARSE_INCOMPLETE;
+    }
+
+    body_ = string_ref(text + head_length_, content_length_);
+
+    return parse_state::PARSE_COMPLETE;
+}
+
+void http_request::clear()
+{
+    scanned_ = 0;
+    head_length_ = 0;
+    content_length_ = 0;
+    method_ = string_ref();
+    target_ = string_ref();
+    version_ = 0;
+    headers_.clear();
+    body_ = string_ref();
+    keep_alive_ = false;
+}
+
+parse_state http_request::parse_head(const char* data, size_t size)
+{
+    const char* pos = data;
+    const char* end = data + size;
+
+    headers_.clear();
+    content_length_ = 0;
+
+    // Request line: METHOD SP TARGET SP HTTP/1.x CRLF
+    const char* eol = std::search(pos, end, "\r\n", "\r\n" + 2);
+    const char* sp1 = std::find(pos, eol, ' ');
+    const char* sp2 = sp1 == eol ? eol : std::find(sp1 + 1, eol, ' ');
+
+    if (sp1 == pos || sp2 == eol || sp2 == sp1 + 1 || eol - sp2 != 9 || ::strncmp(sp2 + 1, "HTTP/1.", 7) != 0)
+    {
+        return parse_state::PARSE_ERROR;
+    }
+
+    method_ = string_ref(pos, sp1 - pos);
+    target_ = string_ref(sp1 + 1, sp2 - sp1 - 1);
+
+    const char minor = sp2[8];
+    if (minor != '0' && minor != '1')
+    {
+        return parse_state::PARSE_ERROR;
+    }
+
+    version_ = minor == '1' ? 11 : 10;
+    keep_alive_ = version_ == 11;
+
+    bool chunked = false;
+    bool has_length = false;
+
+    parse_state rc = parse_headers(eol + 2, end, http_body_limit, headers_, content_length_, has_length, chunked,
+                                   keep_alive_);
+    if (rc != parse_state::PARSE_COMPLETE)
+    {
+        return rc;
+    }
+
+    // Chunked request bodies are not supported
+    return chunked ? parse_state::PARSE_ERROR : parse_state::PARSE_COMPLETE;
+}
+
+string_ref http_request::method() const
+{
+    return method_;
+}
+
+string_ref http_request::target() const
+{
+    return target_;
+}
+
+int http_request::version() const
+{
+    return version_;
+}
+
+const std::vector<http_header>& http_request::headers() const
+{
+    return headers_;
+}
+
+string_ref http_request::header(const string_ref& name) const
+{
+    for (const http_header& h : headers_)
+    {
+        if (h.name.iequals(name))
+        {
+            return h.value;
+        }
+    }
+
+    return string_ref();
+}
+
+string_ref http_request::body() const
+{
+    return body_;
+}
+
+size_t http_request::length() const
+{
+    return head_length_ + content_length_;
+}
+
+bool http_request::keep_alive() const
+{
+    return keep_alive_;
+}
+
+const size_t http_response::http_body_limit;
+
+http_response::http_response()
+    : scanned_(0),
+      head_length_(0),
+      content_length_(0),
+      status_(0),
+      reason_(),
+      version_(0),
+      headers_(),
+      body_(),
+      keep_alive_(false),
+      head_(false),
+      until_close_(false)
+{
+    headers_.reserve(http_request::http_headers_hint);
+}
+
+parse_state http_response::parse(const unsigned char* data, size_t size, bool closed)
+{
+    const char* text = reinterpret_cast<const char*>(data);
+
+    if (head_length_ == 0)
+    {
+        // Resume the search for the blank line where the previous call stopped
+        size_t from = scanned_ > 3 ? scanned_ - 3 : 0;
+        const char* end = 0;
+
+        for (size_t i = from; i + 3 < size; i++)
+        {
+            if (text[i] == '\r' && text[i + 1] == '\n' && text[i + 2] == '\r' && text[i + 3] == '\n')
+            {
+                end = text + i + 4;
+                break;
+            }
+        }
+
+        if (!end)
+        {
+            scanned_ = size;
+            return size > http_request::http_head_limit ? parse_state::PARSE_ERROR : parse_state::PARSE_INCOMPLETE;
+        }
+
+        head_length_ = end - text;
+
+        parse_state rc = parse_head(text, head_length_);
+        if (rc != parse_state::PARSE_COMPLETE)
+        {
+            return rc;
+        }
+    }
+    else if (until_close_ ? closed : size >= head_length_ + content_length_)
+    {
+        // The caller's buffer may have moved since the head was seen, rebind the views
+        parse_head(text, head_length_);
+    }
+
+    if (until_close_)
+    {
+        if (size - head_length_ > http_body_limit)
+        {
+            return parse_state::PARSE_ERROR;
+        }
+
+        if (!closed)
+        {
+            return parse_state::PARSE_INCOMPLETE;
+        }
+
+        content_length_ = size - head_length_;
+    }
+
+    if (size < head_length_ + content_length_)
+    {
+        return parse_state::PARSE_INCOMPLETE;
+    }
+
+    body_ = string_ref(text + head_length_, content_length_);
+
+    return parse_state::PARSE_COMPLETE;
+}
+
+void http_response::clear(bool head)
+{
+    scanned_ = 0;
+    head_length_ = 0;
+    content_length_ = 0;
+    status_ = 0;
+    reason_ = string_ref();
+    version_ = 0;
+    headers_.clear();
+    body_ = string_ref();
+    keep_alive_ = false;
+    head_ = head;
+    until_close_ = false;
+}
+
+parse_state http_response::parse_head(const char* data, size_t size)
+{
+    const char* pos = data;
+    const char* end = data + size;
+
+    headers_.clear();
+    content_length_ = 0;
+
+    // Status line: HTTP/1.x SP 3DIGIT SP [REASON] CRLF
+    const char* eol = std::search(pos, end, "\r\n", "\r\n" + 2);
+
+    if (eol - pos < 12 || ::strncmp(pos, "HTTP/1.", 7) != 0 || (pos[7] != '0' && pos[7] != '1') || pos[8] != ' ' ||
+        pos[9] < '1' || pos[9] > '5' || pos[10] < '0' || pos[10] > '9' || pos[11] < '0' || pos[11] > '9' ||
+        (eol - pos > 12 && pos[12] != ' '))
+    {
+        return parse_state::PARSE_ERROR;
+    }
+
+    version_ = pos[7] == '1' ? 11 : 10;
+    status_ = (pos[9] - '0') * 100 + (pos[10] - '0') * 10 + (pos[11] - '0');
+    reason_ = eol - pos > 12 ? string_ref(pos + 13, eol - pos - 13) : string_ref();
+    keep_alive_ = version_ == 11;
+
+    bool chunked = false;
+    bool has_length = false;
+
+    parse_state rc = parse_headers(eol + 2, end, http_body_limit, headers_, content_length_, has_length, chunked,
+                                   keep_alive_);
+    if (rc != parse_state::PARSE_COMPLETE)
+    {
+        return rc;
+    }
+
+    // Interim, HEAD, 204 and 304 responses end with the head
+    if (head_ || status_ < 200 || status_ == 204 || status_ == 304)
+    {
+        content_length_ = 0;
+        return parse_state::PARSE_COMPLETE;
+    }
+
+    // Chunked response bodies are not supported either
+    if (chunked)
+    {
+        return parse_state::PARSE_ERROR;
+    }
+
+    if (!has_length)
+    {
+        until_close_ = true;
+        keep_alive_ = false;
+    }
+
+    return parse_state::PARSE_COMPLETE;
+}
+
+int http_response::status() const
+{
+    return status_;
+}
+
+string_ref http_response::reason() const
+{
+    return reason_;
+}
+
+int http_response::version() const
+{
+    return version_;
+}
+
+const std::vector<http_header>& http_response::headers() const
+{
+    return headers_;
+}
+
+string_ref http_response::header(const string_ref& name) const
+{
+    for (const http_header& h : headers_)
+    {
+        if (h.name.iequals(name))
+        {
+            return h.value;
+        }
+    }
+
+    return string_ref();
+}
+
+string_ref http_response::body() const
+{
+    return body_;
+}
+
+size_t http_response::length() const
+{
+    return head_length_ + content_length_;
+}
+
+bool http_response::keep_alive() const
+{
+    return keep_alive_;
+}
+
+const size_t datagram_queue::datagram_segments_hint;
+const size_t datagram_queue::datagram_segment_bytes_hint;
+
+datagram_queue::datagram_queue()
+    : arena_(),
+      entries_(),
+      iov_(),
+      headers_(),
+      control_()
+{
+}
+
+void datagram_queue::send(const address& peer, const slice& data)
+{
+    entries_.emplace_back();
+    entry& e = entries_.back();
+    e.peer = peer;
+    e.offset = arena_.size();
+    e.size = data.size();
+
+    arena_.insert(arena_.end(), data.data(), data.data() + data.size());
+}
+
+size_t datagram_queue::size() const
+{
+    return entries_.size();
+}
+
+void datagram_queue::clear()
+{
+    // Capacity stays, the next batch reuses it
+    arena_.clear();
+    entries_.clear();
+}
+
+size_t datagram_queue::flush(const socket& sock, bool segment)
+{
+    const size_t control_size = CMSG_SPACE(sizeof(uint16_t));
+
+    iov_.resize(entries_.size());
+    headers_.resize(entries_.size());
+    control_.resize(entries_.size() * control_size);
+
+    size_t count = 0;
+
+    for (size_t i = 0; i < entries_.size(); )
+    {
+        const entry& first = entries_[i];
+        size_t length = first.size;
+        size_t j = i + 1;
+
+        // Only the last segment of a GSO send may be shorter than the others
+        while (segment && j < entries_.size() && j - i < datagram_segments_hint &&
+               entries_[j - 1].size == first.size && entries_[j].size <= first.size && first.size > 0 &&
+               length + entries_[j].size <= datagram_segment_bytes_hint &&
+               entries_[j].peer == first.peer)
+        {
+            length += entries_[j].size;
+            j++;
+        }
+
+        iov_[count].iov_base = arena_.data() + first.offset;
+        iov_[count].iov_len = length;
+
+        struct mmsghdr& header = headers_[count];
+        ::memset(&header, 0, sizeof(header));
+        header.msg_hdr.msg_name = const_cast<sockaddr*>(static_cast<const sockaddr*>(first.peer));
+        header.msg_hdr.msg_namelen = first.peer.size();
+        header.msg_hdr.msg_iov = &iov_[count];
+        header.msg_hdr.msg_iovlen = 1;
+
+        if (j - i > 1)
+        {
+            char* buf = &control_[count * control_size];
+            ::memset(buf, 0, control_size);
+
+            header.msg_hdr.msg_control = buf;
+            header.msg_hdr.msg_controllen = control_size;
+
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header.msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+            const uint16_t size = static_cast<uint16_t>(first.size);
+            ::memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+        }
+
+        count++;
+        i = j;
+    }
+
+    size_t sent = 0;
+
+    while (sent < count)
+    {
+        int rc = ::sendmmsg(sock, &headers_[sent], count - sent, 0);
+
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            // Datagrams are best effort: one the kernel refuses is dropped, the rest still go
+            sent++;
+            continue;
+        }
+
+        sent += rc;
+    }
+
+    clear();
+
+    return count;
+}
+
+const unsigned long server::stop_deadline_hint;
+const unsigned long server::accept_retry_hint;
+const size_t server::datagram_batch_hint;
+const size_t server::datagram_size_hint;
+const size_t server::handoff_listeners_hint;
+constexpr const char* server::listener_variable_hint;
+
+server::server()
+    : conn_ctx_(),
+      bind_addr_(),
+      bind_sock_(),
+      reuse_port_(false),
+      twins_(),
+      twins_mutex_(),
+      wake_(),
+      iomutex_(std::make_shared<std::mutex>()),
+      stop_(false),
+      deadline_(0),
+      handoff_(),
+      metrics_mutex_(),
+      metrics_()
+{
+    ::signal(SIGPIPE, SIG_IGN);
+
+    wake_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (wake_ < 0)
+    {
+        throw std::runtime_error(std::string("eventfd() exception: ") + ::strerror(errno));
+    }
+}
+
+server::~server()
+{
+    if (handoff_.joinable())
+    {
+        // Wakes the handoff thread still waiting for a successor
+        stop(0);
+        handoff_.join();
+    }
+}
+
+const server& server::bind(std::string conn, bool reuse_port)
+{
+    conn_ctx_ = util::parse_connection_string(conn);
+    reuse_port_ = reuse_port && conn_ctx_.family != AF_UNIX;
+
+    bind_addr_ = std::move(address(reinterpret_cast<const sockaddr*>(&conn_ctx_.addr), conn_ctx_.addr_size));
+    bind_sock_ = std::move(make_listener());
+
+    return *this;
+}
+
+socket server::make_listener() const
+{
+    socket sock(conn_ctx_.family, conn_ctx_.type, conn_ctx_.protocol);
+
+    if (conn_ctx_.family != AF_UNIX)
+    {
+        sock.reuse();
+    }
+
+    if (reuse_port_)
+    {
+        // Every reactor binds its own socket to the same address, the kernel shards accepts
+        sock.reuse_port();
+    }
+
+    if (conn_ctx_.family == AF_INET6)
+    {
+        // Dual-stack whatever the bindv6only sysctl says: IPv4 peers arrive as ::ffff:a.b.c.d
+        int v6only = 0;
+        if (::setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int)) != 0)
+        {
+            throw std::runtime_error(std::string("setsockopt() exception: ") + ::strerror(errno));
+        }
+    }
+
+    #ifdef BSD
+    int nosigpipe = 1;
+    int rc2 = ::setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(int));
+    if ( rc2 < 0 )
+    {
+        throw std::runtime_error("Setting socket options SO_NOSIGPIPE failed.");
+    }
+    #endif // BSD
+
+
+    int rc3 = ::bind(sock, bind_addr_, bind_addr_.size());
+
+    if (rc3 != 0 && errno == EADDRINUSE && conn_ctx_.family == AF_UNIX && bind_addr_.str()[0] != '@')
+    {
+        // A path nobody listens on any more is left over from a crash and can go
+        socket probe(AF_UNIX, conn_ctx_.type | SOCK_CLOEXEC, 0);
+        if (::connect(probe, bind_addr_, bind_addr_.size()) != 0 && errno == ECONNREFUSED)
+        {
+            ::unlink(bind_addr_.str().c_str());
+            rc3 = ::bind(sock, bind_addr_, bind_addr_.size());
+        }
+    }
+
+    if (rc3 != 0)
+    {
+        throw std::runtime_error("Binding socket failed.");
+    }
+
+    return sock;
+}
+
+const server& server::listen() const
+{
+    // Datagram sockets have no backlog, bind() is all they need
+    if (conn_ctx_.type == SOCK_DGRAM)
+    {
+        return *this;
+    }
+
+    int rc = ::listen(bind_sock_, SOMAXCONN);
+
+    if (rc != 0)
+    {
+        throw std::runtime_error("Listening socket failed.");
+    }
+
+    return *this;
+}
+
+const server& server::adopt(int fd)
+{
+    // Checked before it is taken over: on an exception the descriptor stays the caller's
+    int listening = 0;
+    socklen_t size = sizeof(int);
+    if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) != 0 || !listening)
+    {
+        throw std::runtime_error("Adopted socket is not listening.");
+    }
+
+    sockaddr_storage saddr;
+    socklen_t saddr_sz = sizeof(saddr);
+    if (::getsockname(fd, reinterpret_cast<sockaddr*>(&saddr), &saddr_sz) != 0)
+    {
+        throw std::runtime_error(std::string("getsockname() exception: ") + ::strerror(errno));
+    }
+
+    int type = 0;
+    int protocol = 0;
+    size = sizeof(int);
+    if (::getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &size) != 0)
+    {
+        throw std::runtime_error(std::string("getsockopt() exception: ") + ::strerror(errno));
+    }
+
+    size = sizeof(int);
+    if (::getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &size) != 0)
+    {
+        throw std::runtime_error(std::string("getsockopt() exception: ") + ::strerror(errno));
+    }
+
+    // Reactors started later bind SO_REUSEPORT twins to the same address if the listener allows it
+    int reuse_port = 0;
+    size = sizeof(int);
+    if (::getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse_port, &size) != 0)
+    {
+        reuse_port = 0;
+    }
+
+    // Another process may accept from it too: a listener that polled readable can come up empty
+    int flags = ::fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        throw std::runtime_error(std::string("fcntl() exception: ") + ::strerror(errno));
+    }
+
+    bind_addr_ = std::move(address(reinterpret_cast<const sockaddr*>(&saddr), saddr_sz));
+    reuse_port_ = reuse_port != 0;
+
+    conn_ctx_.family = bind_addr_.family();
+    conn_ctx_.type = type;
+    conn_ctx_.protocol = protocol;
+    conn_ctx_.port = bind_addr_.port();
+    conn_ctx_.addr = saddr;
+    conn_ctx_.addr_size = saddr_sz;
+
+    bind_sock_ = std::move(socket(fd));
+
+    return *this;
+}
+
+bool server::adopt_from(const std::string& path)
+{
+    const address addr = address::local(path);
+    socket sock(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (::connect(sock, addr, addr.size()) != 0)
+    {
+        if (errno == ENOENT || errno == ECONNREFUSED)
+        {
+            return false;
+        }
+
+        throw std::runtime_error(std::string("connect() exception: ") + ::strerror(errno));
+    }
+
+    // Nothing received: the owner went away meanwhile, the caller binds a fresh listener
+    unsigned char byte = 0;
+    std::vector<socket> fds;
+    sock.receive_descriptors(&byte, 1, fds, handoff_listeners_hint);
+    if (fds.empty())
+    {
+        return false;
+    }
+
+    // Released only once adopted, a descriptor that fails the checks is closed here
+    adopt(fds.front());
+    fds.front().release();
+
+    // The predecessor's twins still queue connections of their share of the port
+    std::lock_guard<std::mutex> lock(twins_mutex_);
+    for (size_t i = 1; i < fds.size(); i++)
+    {
+        int listening = 0;
+        socklen_t size = sizeof(int);
+        if (::getsockopt(fds[i], SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) != 0 || !listening)
+        {
+            continue;
+        }
+
+        fds[i].nonblocking();
+        twins_.push_back(std::move(fds[i]));
+    }
+
+    return true;
+}
+
+bool server::adopt_inherited(const std::string& variable)
+{
+    const char* value = ::getenv(variable.c_str());
+    if (!value)
+    {
+        return false;
+    }
+
+    char* end = 0;
+    long fd = ::strtol(value, &end, 10);
+    if (end == value || *end != '\0' || fd < 0 || fd > std::numeric_limits<int>::max())
+    {
+        throw std::runtime_error("Invalid inherited listener descriptor.");
+    }
+
+    // Not passed on to whatever this process starts in turn
+    ::unsetenv(variable.c_str());
+    ::fcntl(static_cast<int>(fd), F_SETFD, FD_CLOEXEC);
+
+    adopt(static_cast<int>(fd));
+
+    return true;
+}
+
+const server& server::share(const std::string& path, unsigned long deadline_ms)
+{
+    if (handoff_.joinable())
+    {
+        throw std::runtime_error("Listener is already shared.");
+    }
+
+    const address addr = address::local(path);
+    socket sock(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    // Left behind by a predecessor that handed off, or one that crashed
+    ::unlink(path.c_str());
+
+    if (::bind(sock, addr, addr.size()) != 0 || ::listen(sock, 1) != 0)
+    {
+        throw std::runtime_error(std::string("Sharing listener failed: ") + ::strerror(errno));
+    }
+
+    handoff_ = std::thread(&server::hand_off, this, sock.release(), path, deadline_ms);
+
+    return *this;
+}
+
+const server& server::inherit(const std::string& variable)
+{
+    int rc = ::fcntl(bind_sock_, F_SETFD, 0);
+    if (rc != 0)
+    {
+        throw std::runtime_error(std::string("fcntl() exception: ") + ::strerror(errno));
+    }
+
+    ::setenv(variable.c_str(), std::to_string(static_cast<int>(bind_sock_)).c_str(), 1);
+
+    return *this;
+}
+
+void server::hand_off(int unix_fd, std::string path, unsigned long deadline_ms)
+{
+    socket sock(unix_fd);
+    struct pollfd fds[2] = { { sock, POLLIN, 0 }, { wake_, POLLIN, 0 } };
+
+    while (!stop_)
+    {
+        int rc = ::poll(fds, 2, -1);
+
+        if (rc < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        if (rc <= 0 || !fds[0].revents || stop_)
+        {
+            continue;
+        }
+
+        socket peer(::accept4(sock, 0, 0, SOCK_CLOEXEC));
+        if (peer < 0)
+        {
+            continue;
+        }
+
+        // Unlinked first: the successor binds the same path as soon as it holds the listener
+        ::unlink(path.c_str());
+
+        // The single payload byte carries nothing, the listeners travel as SCM_RIGHTS. Twins go along,
+        // closing them here would reset what they queued
+        const unsigned char byte = 0;
+        bool sent = false;
+        try
+        {
+            std::lock_guard<std::mutex> lock(twins_mutex_);
+
+            std::vector<int> fds(1, bind_sock_);
+            for (const socket& twin : twins_)
+            {
+                if (fds.size() < handoff_listeners_hint)
+                {
+                    fds.push_back(twin);
+                }
+            }
+
+            sent = peer.send_descriptors(slice(&byte, 1), fds) == 1;
+        }
+        catch(std::exception&)
+        {
+            // Nothing escapes the handoff thread, the successor just gets no listener
+        }
+
+        if (sent)
+        {
+            stop(deadline_ms);
+        }
+
+        // Otherwise the successor went away before taking it, keep serving without a handoff point
+        return;
+    }
+
+    ::unlink(path.c_str());
+}
+
+const server& server::stop(unsigned long deadline_ms)
+{
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(deadline_ms);
+
+    deadline_ = deadline.time_since_epoch().count();
+    stop_ = true;
+
+    // Never read back: it stays readable and every reactor's epoll reports it once
+    const uint64_t one = 1;
+    ssize_t rc = ::write(wake_, &one, sizeof(one));
+    (void)rc;
+
+    return *this;
+}
+
+bool server::stopped() const
+{
+    return stop_;
+}
+
+metrics_snapshot server::metrics() const
+{
+    metrics_snapshot snapshot;
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+
+    // Only guards the shard list, reactors keep recording meanwhile
+    for (const auto& shard : metrics_)
+    {
+        shard->snapshot(snapshot);
+    }
+
+    return snapshot;
+}
+
+reactor_metrics* server::attach_metrics() const
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex_);
+    metrics_.push_back(std::unique_ptr<reactor_metrics>(new reactor_metrics()));
+
+    return metrics_.back().get();
+}
+
+bool server::wait_accept(std::vector<const socket*>& ready) const
+{
+    // Twins are only there when adopted along with the listener, the accept loops serve them too
+    std::vector<struct pollfd> fds(1, pollfd{ wake_, POLLIN, 0 });
+    fds.push_back(pollfd{ bind_sock_, POLLIN, 0 });
+    for (const socket& twin : twins_)
+    {
+        fds.push_back(pollfd{ twin, POLLIN, 0 });
+    }
+
+    ready.clear();
+
+    while (!stop_)
+    {
+        int rc = ::poll(fds.data(), fds.size(), -1);
+
+        if (rc < 0 && errno != EINTR)
+        {
+            throw std::runtime_error(std::string("poll() exception: ") + ::strerror(errno));
+        }
+
+        for (size_t i = 1; rc > 0 && i < fds.size() && !stop_; i++)
+        {
+            if (fds[i].revents)
+            {
+                ready.push_back(i == 1 ? &bind_sock_ : &twins_[i - 2]);
+            }
+        }
+
+        if (!ready.empty())
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void server::take_backlog(const socket& listener, std::vector<std::pair<socket, address>>& batch) const
+{
+    // Accepted sockets stay blocking, as for the thread per connection loops
+    listener.nonblocking();
+    accept(listener, batch, SOCK_CLOEXEC);
+}
+
+void server::take_backlog(std::vector<std::pair<socket, address>>& batch) const
+{
+    take_backlog(bind_sock_, batch);
+
+    for (const socket& twin : twins_)
+    {
+        take_backlog(twin, batch);
+    }
+}
+
+std::chrono::steady_clock::time_point server::deadline() const
+{
+    return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(deadline_));
+}
+
+unsigned long server::remaining_ms() const
+{
+    const std::chrono::steady_clock::duration left = deadline() - std::chrono::steady_clock::now();
+
+    // At least 1: a zero wait would block without a timeout
+    return std::max<long long>(1, std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1);
+}
+
+int server::tracker::enter(const socket& sock)
+{
+    // shutdown() acts on the socket, not the descriptor: the duplicate reaches the connection
+    // whatever the handler did with its own
+    int handle = ::fcntl(sock, F_DUPFD_CLOEXEC, 0);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    active++;
+
+    if (handle >= 0)
+    {
+        try
+        {
+            live.insert(handle);
+        }
+        catch(...)
+        {
+            ::close(handle);
+            handle = -1;
+        }
+    }
+
+    return handle;
+}
+
+void server::tracker::leave(int handle)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (handle >= 0)
+    {
+        live.erase(handle);
+        ::close(handle);
+    }
+
+    if (--active == 0)
+    {
+        idle.notify_all();
+    }
+}
+
+bool server::tracker::wait_until(std::chrono::steady_clock::time_point deadline)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (idle.wait_until(lock, deadline, [this]() { return active == 0; }))
+    {
+        return true;
+    }
+
+    // Handlers blocked on these sockets return, their threads and tasks then leave
+    for (int handle : live)
+    {
+        ::shutdown(handle, SHUT_RDWR);
+    }
+
+    return false;
+}
+
+std::pair<socket, address> server::accept() const
+{
+    return accept(bind_sock_);
+}
+
+std::pair<socket, address> server::accept(const socket& sock_in) const
+{
+    sockaddr_storage saddr;
+    socklen_t saddr_sz = sizeof(saddr);
+    socket sock_out(::accept(sock_in, reinterpret_cast<sockaddr*>(&saddr), &saddr_sz));
+    address addr(reinterpret_cast<const sockaddr*>(&saddr), sock_out >= 0 ? saddr_sz : 0);
+
+    reactor_metrics* shard = reactor_metrics::current();
+    if (shard && sock_out >= 0)
+    {
+        shard->count(metric::METRIC_ACCEPTS);
+    }
+    else if (shard && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        shard->count(metric::METRIC_EAGAINS);
+    }
+
+    return std::make_pair(std::move(sock_out), std::move(addr));
+}
+
+namespace
+{
+    // Kept open by every accepting thread and given up when descriptors run out
+    struct spare_descriptor
+    {
+        int fd;
+
+        spare_descriptor() : fd(::open("/dev/null", O_RDONLY | O_CLOEXEC)) { }
+        ~spare_descriptor() { if (fd >= 0) ::close(fd); }
+    };
+
+    thread_local spare_descriptor spare;
+}
+
+bool server::accept(const socket& sock_in, std::vector<std::pair<socket, address>>& batch, int flags) const
+{
+    static_assert(std::is_nothrow_move_constructible<std::pair<socket, address>>::value,
+            "a growing accept batch must move its sockets, a copy would close them");
+
+    // Opened on the thread's first accept, while descriptors are still to be had
+    spare_descriptor& reserve = spare;
+    const size_t batch_start = batch.size();
+    bool drained = true;
+    uint64_t dropped = 0;
+
+    // Edge-triggered listener: drain the backlog until EAGAIN
+    while (true)
+    {
+        sockaddr_storage saddr;
+        socklen_t saddr_sz = sizeof(saddr);
+        int fd = ::accept4(sock_in, reinterpret_cast<sockaddr*>(&saddr), &saddr_sz, flags);
+
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+
+            // Out of descriptors: no new edge comes for what is queued, so make room with the spare
+            // one to accept and close the next connection instead of leaving the backlog stalled
+            if ((errno == EMFILE || errno == ENFILE) && reserve.fd >= 0)
+            {
+                ::close(reserve.fd);
+                int shed = ::accept4(sock_in, 0, 0, SOCK_CLOEXEC);
+                int shed_errno = errno;
+
+                if (shed >= 0)
+                {
+                    ::close(shed);
+                    dropped++;
+                }
+
+                reserve.fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+                if (shed >= 0)
+                {
+                    continue;
+                }
+
+                errno = shed_errno;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+            }
+
+            // Short of memory or without a spare: the caller polls the listener again shortly
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                drained = false;
+                break;
+            }
+
+            // Stopping: a listener shut down from outside only ends the final sweep
+            if (errno == EINVAL && stop_)
+            {
+                break;
+            }
+
+            throw std::runtime_error(std::string("accept4() exception: ") + ::strerror(errno));
+        }
+
+        // Built in place: the peer is copied once, straight into its inline storage
+        batch.emplace_back(std::piecewise_construct, std::forward_as_tuple(fd),
+                           std::forward_as_tuple(reinterpret_cast<const sockaddr*>(&saddr), saddr_sz));
+    }
+
+    if (reactor_metrics* shard = reactor_metrics::current())
+    {
+        // Every batch ends on the listener turning the next accept away
+        shard->count(metric::METRIC_ACCEPTS, batch.size() - batch_start);
+        shard->count(metric::METRIC_ACCEPT_DROPS, dropped);
+        shard->count(metric::METRIC_EAGAINS);
+    }
+
+    return drained;
+}
+
+const server& server::accept_block(std::function<void(socket, address, std::mutex&)> fn) const
+{
+    return accept_block<std::function<void(socket, address, std::mutex&)>>(std::move(fn));
+}
+
+
+const server& server::accept_async(std::function<void(socket, address, std::mutex&)> fn) const
+{
+    return accept_async<std::function<void(socket, address, std::mutex&)>>(std::move(fn));
+}
+
+const server& server::accept_epoll(std::function<void(socket, address, std::mutex&)> fn) const
+{
+    return accept_epoll<std::function<void(socket, address, std::mutex&)>>(std::move(fn));
+}
+
+const server& server::accept_reactors(std::function<void(socket, address, std::mutex&)> fn, size_t reactors) const
+{
+    return accept_reactors<std::function<void(socket, address, std::mutex&)>>(std::move(fn), reactors);
+}
+
+const server& server::accept_http(std::function<void(const http_request&, connection&)> fn, size_t reactors,
+        engine kind) const
+{
+    return accept_http<std::function<void(const http_request&, connection&)>>(std::move(fn), reactors, kind);
+}
+
+const server& server::accept_pool(std::function<void(socket, address, std::mutex&)> fn, thread_pool& pool,
+        pool_policy policy) const
+{
+    // Counts accepts only, handlers run on the pool
+    reactor_metrics::scope instrumented(attach_metrics());
+    std::shared_ptr<std::function<void(socket, address, std::mutex&)>> handler =
+        std::make_shared<std::function<void(socket, address, std::mutex&)>>(std::move(fn));
+    tracker_t connections = std::make_shared<tracker>();
+    std::shared_ptr<std::mutex> iomutex = iomutex_;
+    std::vector<const socket*> ready;
+
+    while (wait_accept(ready))
+    {
+        for (const socket* listener : ready)
+        {
+            std::pair<socket, address> accepted = accept(*listener);
+
+            if (accepted.first < 0)
+            {
+                continue;
+            }
+
+            std::shared_ptr<std::pair<socket, address>> pac =
+                std::make_shared<std::pair<socket, address>>(std::move(accepted));
+
+            const int handle = connections->enter(pac->first);
+
+            thread_pool::task_t task = [handler, connections, iomutex, pac, handle]()
+            {
+                tracker::guard done(*connections, handle);
+                serve(*handler, *pac, *iomutex);
+            };
+
+            switch (policy)
+            {
+                case pool_policy::POOL_BLOCK:
+                    try
+                    {
+                        pool.submit(std::move(task));
+                    }
+                    catch(...)
+                    {
+                        connections->leave(handle);
+                        throw;
+                    }
+                    break;
+
+                case pool_policy::POOL_SHED:
+                    if (!pool.try_submit(std::move(task)))
+                    {
+                        pac->first.abort();
+                        connections->leave(handle);
+                    }
+                    break;
+
+                case pool_policy::POOL_INLINE:
+                    if (!pool.try_submit(task))
+                    {
+                        // Caught like a pool worker would, a throwing handler must not end the accept loop.
+                        // The task's tracker guard has already left
+                        try
+                        {
+                            task();
+                        }
+                        catch(std::exception& e)
+                        {
+                            std::cerr << "server handler exception: " << e.what() << std::endl;
+                        }
+                    }
+                    break;
+            }
+        }
+    }
+
+    std::vector<std::pair<socket, address>> backlog;
+    take_backlog(backlog);
+
+    for (auto& accepted : backlog)
+    {
+        std::shared_ptr<std::pair<socket, address>> pac =
+            std::make_shared<std::pair<socket, address>>(std::move(accepted));
+
+        const int handle = connections->enter(pac->first);
+
+        try
+        {
+            pool.submit([handler, connections, iomutex, pac, handle]()
+            {
+                tracker::guard done(*connections, handle);
+                serve(*handler, *pac, *iomutex);
+            });
+        }
+        catch(...)
+        {
+            connections->leave(handle);
+            throw;
+        }
+    }
+
+    connections->wait_until(deadline());
+
+    return *this;
+}
+
+const server& server::accept_events(std::function<void(epoll_state, connection&)> fn, size_t reactors,
+        engine kind) const
+{
+    return accept_events<std::function<void(epoll_state, connection&)>>(std::move(fn), reactors, kind);
+}
+
+const server& server::serve_datagrams(std::function<void(const std::vector<datagram>&, datagram_queue&)> fn,
+        size_t reactors, bool offload, size_t datagram_size) const
+{
+    return serve_datagrams<std::function<void(const std::vector<datagram>&, datagram_queue&)>>(std::move(fn),
+            reactors, offload, datagram_size);
+}
+
+void server::run_datagram_reactor(const socket& sock,
+        const std::function<void(const std::vector<datagram>&, datagram_queue&)>& fn, bool offload,
+        size_t datagram_size) const
+{
+    reactor_metrics::scope instrumented(attach_metrics());
+
+    // Kernels without UDP offload refuse the options, datagrams then come and go one by one
+    bool gro = false;
+    bool gso = false;
+
+    if (offload)
+    {
+        int enable = 1;
+        gro = ::setsockopt(sock, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+
+        int segment = 0;
+        socklen_t size = sizeof(segment);
+        gso = ::getsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment, &size) == 0;
+    }
+
+    // A GRO read coalesces segments of one flow into a single message of up to 64 KiB
+    const size_t message_size = std::max<size_t>(gro ? 65536 : 1, datagram_size);
+    const size_t control_size = CMSG_SPACE(sizeof(int));
+
+    // Receive arena, set up once and reused by every recvmmsg()
+    std::vector<unsigned char> payload(datagram_batch_hint * message_size);
+    std::vector<sockaddr_storage> names(datagram_batch_hint);
+    std::vector<struct iovec> iov(datagram_batch_hint);
+    std::vector<char> control(datagram_batch_hint * control_size);
+    std::vector<struct mmsghdr> headers(datagram_batch_hint);
+
+    std::vector<datagram> batch;
+    batch.reserve(datagram_batch_hint);
+    datagram_queue replies;
+
+    // True while a full batch came in and more may be waiting
+    auto receive = [&]()
+    {
+        for (size_t i = 0; i < datagram_batch_hint; i++)
+        {
+            iov[i].iov_base = &payload[i * message_size];
+            iov[i].iov_len = message_size;
+
+            struct msghdr& msg = headers[i].msg_hdr;
+            msg.msg_name = &names[i];
+            msg.msg_namelen = sizeof(sockaddr_storage);
+            msg.msg_iov = &iov[i];
+            msg.msg_iovlen = 1;
+            msg.msg_control = gro ? &control[i * control_size] : 0;
+            msg.msg_controllen = gro ? control_size : 0;
+            msg.msg_flags = 0;
+            headers[i].msg_len = 0;
+        }
+
+        int received = ::recvmmsg(sock, headers.data(), headers.size(), MSG_DONTWAIT, 0);
+
+        if (received < 0)
+        {
+            if (errno == EINTR)
+            {
+                return true;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (reactor_metrics* shard = reactor_metrics::current())
+                {
+                    shard->count(metric::METRIC_EAGAINS);
+                }
+
+                return false;
+            }
+
+            throw std::runtime_error(std::string("recvmmsg() exception: ") + ::strerror(errno));
+        }
+
+        batch.clear();
+
+        for (int i = 0; i < received; i++)
+        {
+            struct msghdr& msg = headers[i].msg_hdr;
+            const size_t length = headers[i].msg_len;
+            size_t segment = length;
+
+            // Larger than a slot: cut short by the kernel, dropped
+            if (msg.msg_flags & MSG_TRUNC)
+            {
+                if (reactor_metrics* shard = reactor_metrics::current())
+                {
+                    shard->count(metric::METRIC_TRUNCATED);
+                }
+
+                continue;
+            }
+
+            for (struct cmsghdr* cmsg = gro ? CMSG_FIRSTHDR(&msg) : 0; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                {
+                    int gso_size = 0;
+                    ::memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(int));
+                    segment = gso_size > 0 ? gso_size : length;
+                }
+            }
+
+            const unsigned char* data = &payload[i * message_size];
+            const address peer(reinterpret_cast<const sockaddr*>(&names[i]), msg.msg_namelen);
+
+            // Every coalesced segment is a datagram of its own again, an empty one included
+            segment = std::max<size_t>(segment, 1);
+            size_t offset = 0;
+
+            do
+            {
+                batch.push_back({ slice(data + offset, std::min(segment, length - offset)), peer });
+                offset += segment;
+            }
+            while (offset < length);
+        }
+
+        if (!batch.empty())
+        {
+            fn(batch, replies);
+            replies.flush(sock, gso);
+        }
+
+        return received == static_cast<int>(headers.size());
+    };
+
+    epoll ep;
+    ep.add_socket(sock, 0, false);
+    ep.add_socket(wake_, 0, false);
+
+    while (!stop_)
+    {
+        ep.wait(1000);
+        ep.dispatch([&](epoll_state state, const socket& ready)
+        {
+            // Edge-triggered: read until the queue runs dry
+            if (static_cast<int>(ready) == static_cast<int>(sock) && state == epoll_state::EPOLL_READ)
+            {
+                while (receive() && !stop_)
+                {
+                }
+            }
+        });
+    }
+}
+
+void server::spawn_reactors(size_t reactors, const std::function<void(const socket&)>& loop) const
+{
+    if (reactors == 0)
+    {
+        reactors = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // The bound socket serves the first reactor, with reuse_port the rest get their own twins.
+    // Otherwise every reactor accepts from the one listener. Twins handed over by a predecessor
+    // get a reactor each, whatever the count asked for
+    {
+        std::lock_guard<std::mutex> lock(twins_mutex_);
+
+        while (reuse_port_ && twins_.size() + 1 < reactors)
+        {
+            socket listener = make_listener();
+
+            int rc = conn_ctx_.type != SOCK_DGRAM ? ::listen(listener, SOMAXCONN) : 0;
+            if (rc != 0)
+            {
+                throw std::runtime_error("Listening socket failed.");
+            }
+
+            twins_.push_back(std::move(listener));
+        }
+
+        reactors = std::max(reactors, twins_.size() + 1);
+    }
+
+    if (reactors == 1)
+    {
+        loop(bind_sock_);
+        return;
+    }
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::vector<std::thread> threads;
+    threads.reserve(reactors);
+
+    for (size_t i = 0; i < reactors; i++)
+    {
+        const socket& listener = i == 0 || i > twins_.size() ? bind_sock_ : twins_[i - 1];
+
+        threads.push_back(std::thread([&](const socket& sock)
+        {
+            try
+            {
+                loop(sock);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        }, std::cref(listener)));
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    // Closes only these descriptors, a successor that was handed the twins keeps them open
+    {
+        std::lock_guard<std::mutex> lock(twins_mutex_);
+        twins_.clear();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+namespace
+{
+    // Operation kind is kept in the low bits of the (16-byte aligned) session pointer
+    enum uring_op
+    {
+        URING_ACCEPT,
+        URING_RECV,
+        URING_SEND,
+        URING_SPLICE_IN,
+        URING_SPLICE_OUT,
+        URING_POLL,
+        URING_CLOSE,
+        URING_CANCEL,
+        URING_PROVIDE,
+        URING_WAKE
+    };
+
+    const uint64_t uring_op_mask = 0xF;
+
+    // Pipe capacity bounds a file→pipe splice so it never blocks on a full pipe
+    const size_t uring_splice_chunk = 64 * 1024;
+
+    // Descriptor to session table, grows past it with the descriptors
+    const size_t uring_sessions_hint = 1024;
+
+    struct alignas(16) uring_session
+    {
+        connection* conn;
+        int fd;
+        int pipe_in;
+        int pipe_out;
+        size_t piped;
+        size_t inflight;
+        bool sending;
+        bool receiving;
+        bool closing;
+        // Unsent data is dropped, once no send in flight reads from it
+        bool discarding;
+        bool multishot;
+
+        uring_session()
+            : conn(0), fd(-1), pipe_in(-1), pipe_out(-1), piped(0), inflight(0),
+              sending(false), receiving(false), closing(false), discarding(false), multishot(false) { }
+
+        ~uring_session()
+        {
+            if (pipe_in >= 0)
+            {
+                ::close(pipe_in);
+                ::close(pipe_out);
+            }
+        }
+    };
+
+    inline uint64_t uring_tag(uring_session* session, uring_op op)
+    {
+        return reinterpret_cast<uint64_t>(session) | op;
+    }
+}
+
+bool server::run_uring_reactor(const socket& listener, const std::function<void(epoll_state, connection&)>& fn) const
+{
+    reactor_metrics& metrics = *attach_metrics();
+    reactor_metrics::scope instrumented(&metrics);
+    const uint16_t group = 0;
+    std::vector<unsigned char> buffers(uring_buffer_count * uring_buffer_size);
+
+    // Sessions, connections and their buffers are recycled by this reactor only
+    block_pool blocks;
+    slab<connection> connections;
+    slab<uring_session> sessions;
+    std::vector<uring_session*> by_fd(uring_sessions_hint, 0);
+    bool draining = false;
+    bool aborting = false;
+    bool accepted = false;
+    bool unsupported = false;
+    // Cleared by the first receive turned down, single-shot receives are re-armed one by one
+    bool multishot_recv = true;
+    bool received = false;
+    // Set while accepts wait for descriptors or memory to free up
+    std::chrono::steady_clock::time_point accept_resume;
+
+    uring ring;
+    ring.provide_buffers(buffers.data(), uring_buffer_size, uring_buffer_count, group, 0, URING_PROVIDE);
+    ring.accept(listener, SOCK_NONBLOCK | SOCK_CLOEXEC, URING_ACCEPT);
+    ring.poll(wake_, POLLIN, URING_WAKE);
+
+    // Starts the next send for a session once the previous one completed
+    auto pump = [&](uring_session& s)
+    {
+        connection& conn = *s.conn;
+
+        // The kernel is done with the queued bytes and whatever holds them
+        if (s.discarding && !s.sending && conn.pending())
+        {
+            conn.consumed(conn.pending());
+        }
+
+        if (!s.closing && !s.sending && conn.pending())
+        {
+            const connection::segment& seg = conn.queue_.front();
+
+            if (s.piped)
+            {
+                ring.splice(s.pipe_out, -1, conn.sock(), s.piped, uring_tag(&s, URING_SPLICE_OUT));
+            }
+            else if (seg.file)
+            {
+                if (s.pipe_in < 0)
+                {
+                    int fds[2];
+                    if (::pipe2(fds, O_CLOEXEC) != 0)
+                    {
+                        throw std::runtime_error(std::string("pipe2() exception: ") + ::strerror(errno));
+                    }
+
+                    s.pipe_out = fds[0];
+                    s.pipe_in = fds[1];
+                }
+
+                size_t chunk = std::min(seg.remaining, uring_splice_chunk);
+                ring.splice(seg.file->fd(), seg.offset, s.pipe_in, chunk, uring_tag(&s, URING_SPLICE_IN));
+            }
+            else
+            {
+                // The kernel reads the bytes until the completion, a handler queueing more must not move them
+                conn.seal();
+
+                int flags = MSG_NOSIGNAL | (conn.queue_.size() > 1 ? MSG_MORE : 0);
+                ring.send(conn.sock(), conn.bytes(seg), seg.remaining, flags, uring_tag(&s, URING_SEND));
+            }
+
+            s.sending = true;
+            s.inflight++;
+        }
+
+        if (!s.closing && conn.resumed() && !conn.closed())
+        {
+            fn(epoll_state::EPOLL_WRITE, conn);
+        }
+
+        // Draining: done once nothing is read, queued or waiting in the socket
+        if (draining && !s.closing && !s.sending && !conn.pending() && conn.input_.empty() &&
+            !conn.sock().available())
+        {
+            conn.close();
+        }
+
+        if (!s.closing && conn.closed() && !conn.pending() && !s.sending)
+        {
+            s.closing = true;
+
+            if (s.receiving)
+            {
+                ring.cancel(uring_tag(&s, URING_RECV), uring_tag(&s, URING_CANCEL));
+            }
+        }
+
+        if (s.closing && s.inflight == 0)
+        {
+            // Last reference from the kernel is gone, close through the ring
+            s.inflight++;
+            ring.close(s.conn->socket_.release(), uring_tag(&s, URING_CLOSE));
+        }
+    };
+
+    auto receive = [&](uring_session& s)
+    {
+        s.receiving = true;
+        s.multishot = multishot_recv;
+        s.inflight++;
+
+        ring.recv(s.conn->sock(), group, uring_tag(&s, URING_RECV), multishot_recv);
+    };
+
+    auto release = [&](uring_session* s)
+    {
+        by_fd[s->fd] = 0;
+        connections.destroy(s->conn);
+        sessions.destroy(s);
+    };
+
+    auto adopt = [&](int fd, address&& addr)
+    {
+        uring_session* s = sessions.make();
+        s->fd = fd;
+
+        try
+        {
+            s->conn = connections.make(socket(fd), std::move(addr), nullptr, &blocks);
+        }
+        catch(...)
+        {
+            sessions.destroy(s);
+            throw;
+        }
+
+        if (static_cast<size_t>(fd) >= by_fd.size())
+        {
+            by_fd.resize(fd + 1, 0);
+        }
+
+        by_fd[fd] = s;
+
+        s->conn->deferred_ = true;
+
+        receive(*s);
+    };
+
+    auto fail = [&](uring_session& s, epoll_state state)
+    {
+        connection& conn = *s.conn;
+
+        if (!conn.closed())
+        {
+            fn(state, conn);
+        }
+
+        // Unsent data has nowhere to go, it is dropped by pump() once no send reads it
+        s.discarding = true;
+        conn.close();
+    };
+
+    // Built once, a capturing lambda wrapped anew on each wait() would allocate
+    const std::function<void(const io_uring_cqe&)> handler = [&](const io_uring_cqe& cqe)
+    {
+        const uring_op op = static_cast<uring_op>(cqe.user_data & uring_op_mask);
+        uring_session* session = reinterpret_cast<uring_session*>(cqe.user_data & ~uring_op_mask);
+        const bool more = cqe.flags & IORING_CQE_F_MORE;
+
+        switch (op)
+        {
+            case URING_ACCEPT:
+            {
+                if (cqe.res >= 0)
+                {
+                    sockaddr_storage saddr;
+                    socklen_t saddr_sz = sizeof(saddr);
+                    if (::getpeername(cqe.res, reinterpret_cast<sockaddr*>(&saddr), &saddr_sz) != 0)
+                    {
+                        saddr_sz = 0;
+                    }
+
+                    metrics.count(metric::METRIC_ACCEPTS);
+                    accepted = true;
+
+                    adopt(cqe.res, address(reinterpret_cast<const sockaddr*>(&saddr), saddr_sz));
+                }
+                else if (cqe.res == -EINVAL && !accepted && !stop_)
+                {
+                    // Kernels before 5.19 turn IORING_ACCEPT_MULTISHOT down
+                    unsupported = true;
+                    return;
+                }
+                else if (cqe.res == -EMFILE || cqe.res == -ENFILE || cqe.res == -ENOBUFS || cqe.res == -ENOMEM)
+                {
+                    // Re-armed at once it would fail at once, every queued connection spinning the loop
+                    if (!more && !draining)
+                    {
+                        accept_resume = std::chrono::steady_clock::now() +
+                                std::chrono::milliseconds(accept_retry_hint);
+                    }
+
+                    return;
+                }
+                else if (cqe.res != -ECANCELED && cqe.res != -ECONNABORTED && cqe.res != -EINTR &&
+                         cqe.res != -EAGAIN && !stop_)
+                {
+                    throw std::runtime_error(std::string("io_uring accept exception: ") + ::strerror(-cqe.res));
+                }
+
+                // Stopping: not re-armed, later arrivals are left to whoever holds the listener next
+                if (!more && !draining && !stop_)
+                {
+                    ring.accept(listener, SOCK_NONBLOCK | SOCK_CLOEXEC, URING_ACCEPT);
+                }
+
+                return;
+            }
+
+            case URING_PROVIDE:
+            case URING_CANCEL:
+            case URING_WAKE:
+                return;
+
+            default:
+                break;
+        }
+
+        uring_session& s = *session;
+        connection& conn = *s.conn;
+
+        switch (op)
+        {
+            case URING_RECV:
+            {
+                if (cqe.flags & IORING_CQE_F_BUFFER)
+                {
+                    const uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                    unsigned char* data = &buffers[id * uring_buffer_size];
+
+                    if (cqe.res > 0)
+                    {
+                        ::memcpy(conn.input_.prepare(cqe.res), data, cqe.res);
+                        conn.input_.commit(cqe.res);
+                        conn.received(cqe.res);
+                    }
+
+                    ring.provide_buffers(data, uring_buffer_size, 1, group, id, URING_PROVIDE);
+                }
+
+                if (!more)
+                {
+                    s.receiving = false;
+                    s.inflight--;
+                }
+
+                if (s.closing)
+                {
+                    break;
+                }
+
+                if (cqe.res > 0)
+                {
+                    received = true;
+
+                    if (!conn.closed())
+                    {
+                        fn(epoll_state::EPOLL_READ, conn);
+                    }
+                }
+                else if (cqe.res == -EINVAL && s.multishot && !received)
+                {
+                    // Kernels before 6.0 take multishot accept but turn IORING_RECV_MULTISHOT down
+                    multishot_recv = false;
+                }
+                else if (cqe.res == 0)
+                {
+                    if (!conn.closed())
+                    {
+                        fn(epoll_state::EPOLL_CLOSE, conn);
+                    }
+
+                    conn.close();
+                }
+                else if (cqe.res != -ENOBUFS)
+                {
+                    fail(s, epoll_state::EPOLL_ERROR);
+                }
+
+                // Re-arm unless the peer is gone
+                if (!s.receiving && cqe.res != 0 && !conn.closed())
+                {
+                    receive(s);
+                }
+
+                break;
+            }
+
+            case URING_SEND:
+            {
+                s.sending = false;
+                s.inflight--;
+
+                if (cqe.res >= 0)
+                {
+                    if (!conn.queue_.empty() && static_cast<size_t>(cqe.res) < conn.queue_.front().remaining)
+                    {
+                        metrics.count(metric::METRIC_SHORT_WRITES);
+                    }
+
+                    conn.consumed(cqe.res);
+                }
+                else
+                {
+                    fail(s, epoll_state::EPOLL_ERROR);
+                }
+
+                break;
+            }
+
+            case URING_SPLICE_IN:
+            {
+                s.inflight--;
+
+                if (cqe.res > 0)
+                {
+                    // Stay in the sending state, the pipe is emptied next
+                    s.piped = cqe.res;
+                    s.inflight++;
+                    ring.splice(s.pipe_out, -1, conn.sock(), s.piped, uring_tag(&s, URING_SPLICE_OUT));
+                }
+                else
+                {
+                    s.sending = false;
+                    fail(s, epoll_state::EPOLL_ERROR);
+                }
+
+                break;
+            }
+
+            case URING_SPLICE_OUT:
+            {
+                s.inflight--;
+
+                if (cqe.res > 0)
+                {
+                    if (static_cast<size_t>(cqe.res) < s.piped)
+                    {
+                        metrics.count(metric::METRIC_SHORT_WRITES);
+                    }
+
+                    metrics.count(metric::METRIC_SENDFILE_BYTES, cqe.res);
+                    s.piped -= cqe.res;
+                    conn.consumed(cqe.res);
+                    s.sending = false;
+                }
+                else if (cqe.res == -EAGAIN)
+                {
+                    metrics.count(metric::METRIC_EAGAINS);
+
+                    // Nonblocking socket is full: wait for POLLOUT, then retry the splice
+                    s.inflight += 2;
+                    ring.poll(conn.sock(), POLLOUT, uring_tag(&s, URING_POLL), IOSQE_IO_LINK);
+                    ring.splice(s.pipe_out, -1, conn.sock(), s.piped, uring_tag(&s, URING_SPLICE_OUT));
+                }
+                else
+                {
+                    s.sending = false;
+                    fail(s, epoll_state::EPOLL_ERROR);
+                }
+
+                break;
+            }
+
+            case URING_POLL:
+            {
+                s.inflight--;
+                break;
+            }
+
+            case URING_CLOSE:
+            {
+                release(&s);
+                return;
+            }
+
+            default:
+                break;
+        }
+
+        pump(s);
+    };
+
+    auto release_all = [&]()
+    {
+        for (uring_session* s : by_fd)
+        {
+            if (s)
+            {
+                release(s);
+            }
+        }
+    };
+
+    // Stops accepting, from then on sessions are closed as soon as they go idle
+    auto drain = [&]()
+    {
+        draining = true;
+        ring.cancel(URING_ACCEPT, URING_CANCEL);
+
+        // Take what already sits in the backlog, later arrivals wait for whoever holds the listener next
+        std::vector<std::pair<socket, address>> batch;
+        listener.nonblocking();
+        accept(listener, batch, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        for (auto& accepted : batch)
+        {
+            adopt(accepted.first.release(), std::move(accepted.second));
+        }
+
+        for (uring_session* s : by_fd)
+        {
+            if (s)
+            {
+                pump(*s);
+            }
+        }
+    };
+
+    // Past the deadline: shut the sockets down so every operation in flight completes
+    // and sessions close through the ring, their memory is never freed under the kernel
+    auto abort = [&]()
+    {
+        aborting = true;
+
+        for (uring_session* s : by_fd)
+        {
+            if (s && !s->closing)
+            {
+                ::shutdown(s->fd, SHUT_RDWR);
+                s->discarding = true;
+                s->conn->close();
+                pump(*s);
+            }
+        }
+    };
+
+    try
+    {
+        while (!draining || sessions.live())
+        {
+            const bool paused = accept_resume != std::chrono::steady_clock::time_point();
+            const size_t ready = ring.wait(draining && !aborting ? remaining_ms() : paused ? accept_retry_hint : 1000);
+            ring.dispatch(handler);
+
+            if (unsupported)
+            {
+                std::cerr << "io_uring accept exception: Multishot accept unsupported, falling back to epoll."
+                          << std::endl;
+                break;
+            }
+
+            if (paused && !draining && std::chrono::steady_clock::now() >= accept_resume)
+            {
+                accept_resume = std::chrono::steady_clock::time_point();
+                ring.accept(listener, SOCK_NONBLOCK | SOCK_CLOEXEC, URING_ACCEPT);
+            }
+
+            if (!draining && stop_)
+            {
+                drain();
+            }
+            else if (draining && !aborting && std::chrono::steady_clock::now() >= deadline())
+            {
+                abort();
+            }
+            else if (aborting && !ready)
+            {
+                break;
+            }
+        }
+    }
+    catch(...)
+    {
+        release_all();
+        throw;
+    }
+
+    release_all();
+
+    return !unsupported;
+}
+
+namespace
+{
+    void use_address(connection_info& connection, const address& addr)
+    {
+        connection.family = addr.family();
+        connection.addr_size = addr.size();
+        ::memcpy(&connection.addr, addr, addr.size());
+    }
+
+    // Connection string to socket parameters. Addresses that need no lookup come back right away,
+    // otherwise the result is empty and host and family say what to resolve
+    std::vector<address> parse_endpoint(const std::string& conn, connection_info& connection, std::string& host,
+                                        int& family)
+    {
+        ::memset(&connection, 0, sizeof(connection));
+        connection.family = AF_INET;
+        connection.type = SOCK_STREAM;
+        connection.protocol = IPPROTO_TCP;
+
+        std::vector<std::string> conn_parts  = util::split_connection_string(conn);
+        std::string protocol = conn_parts[0];
+        std::vector<address> candidates;
+        address addr;
+
+        if ((protocol == "unix" || protocol == "unixpacket") && conn_parts.size() == 2)
+        {
+            addr = address::local(conn_parts[1]);
+
+            // SOCK_SEQPACKET keeps message boundaries, every read returns one whole message
+            connection.family = AF_UNIX;
+            connection.type = protocol == "unix" ? SOCK_STREAM : SOCK_SEQPACKET;
+            connection.protocol = 0;
+            use_address(connection, addr);
+
+            candidates.push_back(std::move(addr));
+            return candidates;
+        }
+
+        if (conn_parts.size() != 3)
+        {
+            throw std::runtime_error("Invalid connection string.");
+        }
+
+        host = conn_parts[1];
+        std::string port = conn_parts[2];
+
+        // "tcp4" and "tcp6" pin the family, plain "tcp" takes whatever the host resolves to
+        family = AF_UNSPEC;
+        if (protocol.size() == 4 && (protocol[3] == '4' || protocol[3] == '6'))
+        {
+            family = protocol[3] == '4' ? AF_INET : AF_INET6;
+            protocol.resize(3);
+        }
+
+        if (protocol == "tcp")
+        {
+            connection.type = SOCK_STREAM;
+            connection.protocol = IPPROTO_TCP;
+        }
+        else if (protocol == "udp")
+        {
+            connection.type = SOCK_DGRAM;
+            connection.protocol = IPPROTO_UDP;
+        }
+        else
+        {
+            throw std::runtime_error("Invalid protocol parameter.");
+        }
+
+        std::istringstream strstream(port);
+        strstream >> connection.port;
+
+        if (connection.port <= 0 || connection.port > 65535)
+        {
+            throw std::runtime_error("Invalid port parameter.");
+        }
+
+        if (host.empty() && family == AF_INET6)
+        {
+            candidates.push_back(address(in6addr_any, connection.port));
+        }
+        else if (host.empty())
+        {
+            in_addr any;
+            any.s_addr = INADDR_ANY;
+            candidates.push_back(address(AF_INET, any, connection.port));
+        }
+        else
+        {
+            in_addr in4;
+            in6_addr in6;
+
+            // Literal addresses skip the resolver altogether
+            if (family != AF_INET6 && ::inet_pton(AF_INET, host.c_str(), &in4) > 0)
+            {
+                candidates.push_back(address(AF_INET, in4, connection.port));
+            }
+            else if (family != AF_INET && ::inet_pton(AF_INET6, host.c_str(), &in6) > 0)
+            {
+                candidates.push_back(address(in6, connection.port));
+            }
+            else
+            {
+                return candidates;
+            }
+        }
+
+        use_address(connection, candidates.front());
+
+        return candidates;
+    }
+}
+
+const unsigned long resolver::resolver_ttl_hint;
+
+resolver::resolver(unsigned long ttl_ms)
+    : ttl_ms_(ttl_ms),
+      mutex_(),
+      ready_(),
+      cache_(),
+      queries_(),
+      completions_(),
+      wake_(),
+      stop_(false),
+      thread_()
+{
+    wake_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (wake_ < 0)
+    {
+        throw std::runtime_error(std::string("eventfd() exception: ") + ::strerror(errno));
     }
-    while (rc == EINTR);
 }
 
-bool mutex::try_lock()
+resolver::~resolver()
 {
-    int rc = 0;
-    do
     {
-        rc = ::pthread_mutex_trylock(&mutex_);
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
     }
-    while (rc == EINTR);
 
-    if(rc && (rc!=EBUSY))
+    ready_.notify_all();
+
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+}
+
+resolver& resolver::shared()
+{
+    static resolver instance;
+
+    return instance;
+}
+
+std::string resolver::key(const std::string& host, unsigned short port, int family, int type)
+{
+    return host + '/' + std::to_string(port) + '/' + std::to_string(family) + '/' + std::to_string(type);
+}
+
+bool resolver::literal(const std::string& host, unsigned short port, int family, addresses_t& addresses)
+{
+    in_addr in4;
+    in6_addr in6;
+
+    if (family != AF_INET6 && ::inet_pton(AF_INET, host.c_str(), &in4) > 0)
+    {
+        addresses.push_back(address(AF_INET, in4, port));
+        return true;
+    }
+
+    if (family != AF_INET && ::inet_pton(AF_INET6, host.c_str(), &in6) > 0)
+    {
+        addresses.push_back(address(in6, port));
+        return true;
+    }
+
+    return false;
+}
+
+resolver::addresses_t resolver::resolve(const std::string& host, unsigned short port, int family, int type)
+{
+    addresses_t addresses;
+
+    if (literal(host, port, family, addresses) || lookup_cached(key(host, port, family, type), addresses))
+    {
+        return addresses;
+    }
+
+    std::string error;
+    addresses = lookup(host, port, family, type, error);
+
+    if (addresses.empty())
+    {
+        throw std::runtime_error(std::string("getaddrinfo() exception: ") + error);
+    }
+
+    return addresses;
+}
+
+void resolver::resolve(const std::string& host, unsigned short port, handler_t fn, int family, int type)
+{
+    completion done;
+    done.fn = std::move(fn);
+
+    if (literal(host, port, family, done.addresses) || lookup_cached(key(host, port, family, type), done.addresses))
+    {
+        complete(std::move(done));
+        return;
+    }
+
+    query q;
+    q.host = host;
+    q.port = port;
+    q.family = family;
+    q.type = type;
+    q.fn = std::move(done.fn);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queries_.push_back(std::move(q));
+
+        // Started on first use: a process that never resolves asynchronously never pays for the thread
+        if (!thread_.joinable())
+        {
+            thread_ = std::thread(&resolver::run, this);
+        }
+    }
+
+    ready_.notify_one();
+}
+
+const socket& resolver::sock() const
+{
+    return wake_;
+}
+
+size_t resolver::dispatch()
+{
+    uint64_t count = 0;
+    while (::read(wake_, &count, sizeof(count)) < 0 && errno == EINTR)
+    {
+    }
+
+    std::deque<completion> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready.swap(completions_);
+    }
+
+    for (completion& done : ready)
+    {
+        done.fn(done.addresses, done.error);
+    }
+
+    return ready.size();
+}
+
+size_t resolver::cached() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return cache_.size();
+}
+
+void resolver::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    cache_.clear();
+}
+
+bool resolver::lookup_cached(const std::string& key, addresses_t& addresses)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto found = cache_.find(key);
+    if (found == cache_.end())
+    {
+        return false;
+    }
+
+    if (std::chrono::steady_clock::now() >= found->second.expires)
+    {
+        cache_.erase(found);
+        return false;
+    }
+
+    addresses = found->second.addresses;
+
+    return true;
+}
+
+resolver::addresses_t resolver::lookup(const std::string& host, unsigned short port, int family, int type,
+                                       std::string& error)
+{
+    addrinfo hints;
+    ::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = type;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+
+    const std::string service = std::to_string(port);
+    addrinfo* infos = 0;
+    int rc = ::getaddrinfo(host.c_str(), service.c_str(), &hints, &infos);
+
+    addresses_t addresses;
+
+    if (rc != 0)
+    {
+        error = rc == EAI_SYSTEM ? ::strerror(errno) : ::gai_strerror(rc);
+        return addresses;
+    }
+
+    // RFC 8305 ordering: the family getaddrinfo() prefers first, then the two families take turns
+    addresses_t preferred;
+    addresses_t other;
+    for (addrinfo* info = infos; info; info = info->ai_next)
+    {
+        address addr(info->ai_addr, info->ai_addrlen);
+        (addr.family() == infos->ai_family ? preferred : other).push_back(std::move(addr));
+    }
+
+    ::freeaddrinfo(infos);
+
+    for (size_t i = 0; i < std::max(preferred.size(), other.size()); i++)
+    {
+        if (i < preferred.size())
+        {
+            addresses.push_back(preferred[i]);
+        }
+
+        if (i < other.size())
+        {
+            addresses.push_back(other[i]);
+        }
+    }
+
+    entry cached;
+    cached.addresses = addresses;
+    cached.expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl_ms_);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Expired answers nobody asked for again go on every miss, the cache only holds names in use
+    for (auto it = cache_.begin(); it != cache_.end(); )
+    {
+        it = it->second.expires <= cached.expires - std::chrono::milliseconds(ttl_ms_) ? cache_.erase(it) : ++it;
+    }
+
+    cache_[key(host, port, family, type)] = std::move(cached);
+
+    return addresses;
+}
+
+void resolver::complete(completion&& done)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        completions_.push_back(std::move(done));
+    }
+
+    const uint64_t one = 1;
+    while (::write(wake_, &one, sizeof(one)) < 0 && errno == EINTR)
+    {
+    }
+}
+
+void resolver::run()
+{
+    while (true)
+    {
+        query q;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return stop_ || !queries_.empty(); });
+
+            if (stop_)
+            {
+                return;
+            }
+
+            q = std::move(queries_.front());
+            queries_.pop_front();
+        }
+
+        completion done;
+        done.fn = std::move(q.fn);
+
+        // Asked again while queued behind an earlier lookup of the same name
+        if (!lookup_cached(key(q.host, q.port, q.family, q.type), done.addresses))
+        {
+            done.addresses = lookup(q.host, q.port, q.family, q.type, done.error);
+        }
+
+        complete(std::move(done));
+    }
+}
+
+const unsigned long client::connect_attempt_hint;
+
+client::client()
+    : socket_(),
+      address_()
+{
+}
+
+client::~client()
+{
+}
+
+const client& client::connect(std::string conn)
+{
+    connection_info info;
+    const std::vector<address> candidates = util::resolve_connection_string(conn, info);
+
+    // One address, nothing to race
+    if (candidates.size() == 1)
+    {
+        socket sock(info.family, info.type | SOCK_CLOEXEC, info.protocol);
+
+        int rc;
+        do
+        {
+            rc = ::connect(sock, candidates.front(), candidates.front().size());
+        }
+        while (rc != 0 && errno == EINTR);
+
+        if (rc != 0)
+        {
+            throw std::runtime_error(std::string("connect() exception: ") + ::strerror(errno));
+        }
+
+        socket_ = std::move(sock);
+        address_ = candidates.front();
+
+        return *this;
+    }
+
+    // Attempts in flight, pending[i] connects to candidates[tried[i]]
+    std::vector<socket> pending;
+    std::vector<size_t> tried;
+    std::vector<struct pollfd> fds;
+    size_t next = 0;
+    int error = ECONNREFUSED;
+    int winner = -1;
+
+    while (winner < 0)
+    {
+        // One new attempt per round: after the delay ran out or an attempt failed. One that fails
+        // straight away hands over to the next candidate at once
+        while (next < candidates.size())
+        {
+            const address& addr = candidates[next++];
+            socket sock(addr.family(), info.type | SOCK_NONBLOCK | SOCK_CLOEXEC, info.protocol);
+
+            if (::connect(sock, addr, addr.size()) == 0)
+            {
+                pending.push_back(std::move(sock));
+                tried.push_back(next - 1);
+                winner = static_cast<int>(pending.size() - 1);
+                break;
+            }
+
+            if (errno != EINPROGRESS)
+            {
+                error = errno;
+                continue;
+            }
+
+            pending.push_back(std::move(sock));
+            tried.push_back(next - 1);
+            break;
+        }
+
+        if (winner >= 0)
+        {
+            break;
+        }
+
+        if (pending.empty())
+        {
+            throw std::runtime_error(std::string("connect() exception: ") + ::strerror(error));
+        }
+
+        fds.clear();
+        for (const socket& sock : pending)
+        {
+            fds.push_back({ sock, POLLOUT, 0 });
+        }
+
+        // The last candidate is in flight: wait for it as long as the kernel does
+        int rc = ::poll(fds.data(), fds.size(), next < candidates.size() ? connect_attempt_hint : -1);
+
+        if (rc < 0 && errno != EINTR)
+        {
+            throw std::runtime_error(std::string("poll() exception: ") + ::strerror(errno));
+        }
+
+        for (size_t i = fds.size(); rc > 0 && i-- > 0; )
+        {
+            if (!fds[i].revents)
+            {
+                continue;
+            }
+
+            int so_error = 0;
+            socklen_t size = sizeof(int);
+            ::getsockopt(pending[i], SOL_SOCKET, SO_ERROR, &so_error, &size);
+
+            if (so_error == 0)
+            {
+                winner = static_cast<int>(i);
+                break;
+            }
+
+            error = so_error;
+            pending.erase(pending.begin() + i);
+            tried.erase(tried.begin() + i);
+        }
+    }
+
+    socket sock(std::move(pending[winner]));
+
+    // The losers are closed with pending, the winner goes back to blocking like the single address case
+    int flags = ::fcntl(sock, F_GETFL, 0);
+    if (flags < 0 || ::fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) != 0)
+    {
+        throw std::runtime_error(std::string("fcntl() exception: ") + ::strerror(errno));
+    }
+
+    socket_ = std::move(sock);
+    address_ = candidates[tried[winner]];
+
+    return *this;
+}
+
+const client& client::disconnect()
+{
+    socket_.close();
+
+    return *this;
+}
+
+const socket& client::sock() const
+{
+    return socket_;
+}
+
+const address& client::addr() const
+{
+    return address_;
+}
+
+const size_t http_client::client_max_idle_hint;
+const size_t http_client::client_max_total_hint;
+const size_t http_client::client_pipeline_hint;
+
+http_client::http_client(size_t max_idle, size_t max_total, size_t pipeline)
+    : max_idle_(max_idle),
+      max_total_(std::max<size_t>(1, max_total)),
+      pipeline_(std::max<size_t>(1, pipeline)),
+      poller_(),
+      destinations_(),
+      retired_(),
+      failed_(),
+      completed_(0),
+      names_()
+{
+    // Lookups complete through the client's own loop
+    poller_.add_socket(names_.sock(), &names_, false);
+}
+
+http_client::~http_client()
+{
+}
+
+void http_client::send(const std::string& conn, const std::string& request, handler_t fn)
+{
+    destination& dest = find(conn);
+
+    http_client::request req;
+    req.bytes = request;
+    req.fn = std::move(fn);
+    req.head = request.compare(0, 5, "HEAD ") == 0;
+    req.idempotent = false;
+    req.retried = false;
+
+    static const char* const idempotent[] = { "GET ", "HEAD ", "PUT ", "DELETE ", "OPTIONS ", "TRACE " };
+    for (const char* method : idempotent)
+    {
+        req.idempotent = req.idempotent || request.compare(0, ::strlen(method), method) == 0;
+    }
+
+    dest.waiting.push_back(std::move(req));
+    schedule(dest);
+}
+
+void http_client::get(const std::string& conn, const std::string& target, handler_t fn)
+{
+    const destination& dest = find(conn);
+    std::string host = dest.host.empty() ? std::string("localhost") : dest.host;
+
+    if (host.find(':') != std::string::npos)
+    {
+        host = "[" + host + "]";
+    }
+
+    if (dest.info.port)
+    {
+        host += ":" + std::to_string(dest.info.port);
+    }
+
+    send(conn, "GET " + target + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n", std::move(fn));
+}
+
+size_t http_client::run(unsigned long ms)
+{
+    completed_ = 0;
+
+    // Known failures are reported right away, a zero wait would block and the resolver
+    // eventfd keeps the poller registered
+    if (failed_.empty())
+    {
+        poller_.wait(ms);
+        poller_.dispatch([this](epoll_state state, const socket& sock, void* data)
+        {
+            if (data == &names_)
+            {
+                names_.dispatch();
+                return;
+            }
+
+            completed_ += handle(*static_cast<outbound*>(data), state);
+        });
+    }
+
+    // Unregistered during dispatch, their events are skipped and the memory can go now
+    retired_.clear();
+
+    const http_response none;
+    while (!failed_.empty())
     {
-        throw std::runtime_error("mutex::try_lock error.");
+        std::pair<request, std::string> failure = std::move(failed_.front());
+        failed_.pop_front();
+
+        failure.first.fn(none, failure.second);
+        completed_++;
     }
 
-    return !rc;
+    return completed_;
 }
 
-void mutex::lock()
+size_t http_client::pending() const
 {
-    int rc;
+    size_t count = failed_.size();
 
-    do
+    for (const auto& entry : destinations_)
     {
-        rc = ::pthread_mutex_lock(&mutex_);
-    }
-    while (rc == EINTR);
+        count += entry.second->waiting.size();
 
-    if(rc)
-    {
-        throw std::runtime_error("mutex::lock error.");
+        for (const auto& out : entry.second->connections)
+        {
+            count += out->in_flight.size();
+        }
     }
+
+    return count;
 }
 
-void mutex::unlock()
+size_t http_client::connections() const
 {
-    int rc;
+    size_t count = 0;
 
-    do
+    for (const auto& entry : destinations_)
     {
-        rc = ::pthread_mutex_unlock(&mutex_);
+        count += entry.second->connections.size();
     }
-    while (rc == EINTR);
 
-    if(rc)
-    {
-        throw std::runtime_error("mutex::unlock error.");
-    }
+    return count;
 }
 
-epoll::epoll()
-    : epollfd_(-1),
-      epoll_events_(),
-      wait_events_()
+size_t http_client::idle() const
 {
-    epollfd_ = ::epoll_create(epoll_queue_size_hint);
+    size_t count = 0;
 
-    if (epollfd_ < 0 )
+    for (const auto& entry : destinations_)
     {
-        throw std::runtime_error(std::string("epoll_create() exception: ") + ::strerror(errno));
+        for (const auto& out : entry.second->connections)
+        {
+            count += out->connected && !out->closing && out->in_flight.empty();
+        }
     }
 
-    epoll_events_.reserve(epoll_queue_size_hint);
-    wait_events_.reserve(epoll_queue_size_hint);
+    return count;
 }
 
-epoll::~epoll()
+http_client::destination& http_client::find(const std::string& conn)
 {
-    if (epollfd_ >= 0)
+    auto found = destinations_.find(conn);
+    if (found != destinations_.end())
     {
-        ::close(epollfd_);
-        epollfd_ = -1;
+        return *found->second;
     }
-}
-
-const epoll& epoll::add_socket(const socket& sock)
-{
-    struct epoll_event ev = { 0 };
-    ev.data.fd = sock;
-    ev.events = EPOLLIN | EPOLLOUT | EPOLLPRI | EPOLLET | EPOLLERR | EPOLLHUP | EPOLLRDHUP;
 
-    int rc = ::epoll_ctl(epollfd_, EPOLL_CTL_ADD, sock, &ev);
+    // Parsed before it goes in the map: a bad connection string leaves nothing behind
+    std::unique_ptr<destination> dest(new destination());
+    dest->conn = conn;
+    dest->family = AF_UNSPEC;
+    dest->candidates = parse_endpoint(conn, dest->info, dest->host, dest->family);
+    dest->preferred = 0;
+    dest->failures = 0;
+    dest->resolving = false;
 
-    if (rc != 0)
+    if (dest->info.type == SOCK_DGRAM)
     {
-        throw std::runtime_error(std::string("epoll_ctl() exception: ") + ::strerror(errno));
+        throw std::runtime_error("http_client needs a stream connection string.");
     }
 
-    epoll_events_.push_back(ev);
+    destination& ref = *dest;
+    destinations_[conn] = std::move(dest);
 
-    return *this;
+    return ref;
 }
 
-const epoll& epoll::remove_socket(const socket& sock)
+void http_client::schedule(destination& dest)
 {
-    struct epoll_event ev = { 0 };
+    if (dest.candidates.empty())
+    {
+        if (!dest.resolving && !dest.waiting.empty())
+        {
+            destination* target = &dest;
+            dest.resolving = true;
 
-    int rc = ::epoll_ctl(epollfd_, EPOLL_CTL_DEL, sock, &ev);
+            names_.resolve(dest.host, dest.info.port, [this, target](const resolver::addresses_t& addresses,
+                                                                     const std::string& error)
+            {
+                target->resolving = false;
 
-    if (rc != 0)
-    {
-        throw std::runtime_error(std::string("epoll_ctl() exception: ") + ::strerror(errno));
+                if (addresses.empty())
+                {
+                    fail(target->waiting, "Resolving " + target->host + " failed: " + error);
+                    return;
+                }
+
+                target->candidates = addresses;
+                target->preferred = 0;
+                target->failures = 0;
+                schedule(*target);
+            }, dest.family, dest.info.type);
+        }
+
+        return;
     }
 
-    auto from = std::remove_if(epoll_events_.begin(), epoll_events_.end(),
-    [&sock](const std::vector<struct epoll_event>::value_type& el)
+    while (!dest.waiting.empty())
     {
-        return el.data.fd == sock;
-    });
-    epoll_events_.erase(from, epoll_events_.end());
+        outbound* idle = 0;
+        outbound* pipelined = 0;
 
-    return *this;
-}
+        for (const auto& out : dest.connections)
+        {
+            if (!out->connected || out->closing)
+            {
+                continue;
+            }
 
-bool epoll::wait(unsigned long ms)
-{
-    bool rc = false;
+            if (out->in_flight.empty())
+            {
+                idle = out.get();
+                break;
+            }
 
-    if (epoll_events_.size())
-    {
-        struct epoll_event ev = { 0 };
-        wait_events_.resize(epoll_events_.size());
-        std::fill(wait_events_.begin(), wait_events_.end(), ev);
+            // Only a connection that kept alive once is trusted with a queue behind the request in flight
+            if (out->reused && out->in_flight.size() < pipeline_ &&
+                (!pipelined || out->in_flight.size() < pipelined->in_flight.size()))
+            {
+                pipelined = out.get();
+            }
+        }
 
-        int erc = ::epoll_wait(epollfd_, &wait_events_[0], wait_events_.size(), ms ? ms : -1);
+        outbound* out = idle ? idle : pipelined;
 
-        if (erc < 0)
+        if (!out && dest.connections.size() < max_total_)
         {
-            throw std::runtime_error(std::string("epoll_wait() exception: ") + ::strerror(errno));
+            out = open(dest);
+
+            if (!out)
+            {
+                return;
+            }
         }
 
-        rc = !!erc;
-    }
+        if (!out)
+        {
+            // At the limits, responses coming back make room
+            return;
+        }
 
-    return rc;
+        request req = std::move(dest.waiting.front());
+        dest.waiting.pop_front();
+        assign(*out, std::move(req));
+    }
 }
 
-size_t epoll::dispatch(std::function<void(epoll_state, const socket&)> fn) const
+http_client::outbound* http_client::open(destination& dest)
 {
-    if (wait_events_.size())
+    for (size_t tried = 0; tried < dest.candidates.size(); tried++)
     {
-        std::for_each(wait_events_.begin(), wait_events_.end(),
-        [&fn](const std::vector<struct epoll_event>::value_type& el)
+        const size_t candidate = (dest.preferred + tried) % dest.candidates.size();
+        address addr = dest.candidates[candidate];
+        socket sock(addr.family(), dest.info.type | SOCK_NONBLOCK | SOCK_CLOEXEC, dest.info.protocol);
+
+        int rc;
+        do
         {
-            epoll_state estate =
-                el.events & EPOLLERR    ? epoll_state::EPOLL_ERROR   :
-                el.events & EPOLLIN     ? epoll_state::EPOLL_READ    :
-                el.events & EPOLLPRI    ? epoll_state::EPOLL_READ    :
-                el.events & EPOLLRDNORM ? epoll_state::EPOLL_READ    :
-                el.events & EPOLLRDBAND ? epoll_state::EPOLL_READ    :
-                el.events & EPOLLOUT    ? epoll_state::EPOLL_WRITE   :
-                el.events & EPOLLWRNORM ? epoll_state::EPOLL_WRITE   :
-                el.events & EPOLLWRBAND ? epoll_state::EPOLL_WRITE   :
-                el.events & EPOLLHUP    ? epoll_state::EPOLL_CLOSE   :
-                                          epoll_state::EPOLL_UNKNOWN;
+            rc = ::connect(sock, addr, addr.size());
+        }
+        while (rc != 0 && errno == EINTR);
 
-            fn(estate, socket(el.data.fd));
-        });
-    }
+        if (rc != 0 && errno != EINPROGRESS)
+        {
+            continue;
+        }
 
-    return wait_events_.size();
-}
+        std::unique_ptr<outbound> out(new outbound());
+        out->dest = &dest;
+        out->candidate = candidate;
+        out->connected = false;
+        out->reused = false;
+        out->closing = false;
+        out->delivering = false;
 
-server::server()
-{
-    ::signal(SIGPIPE, SIG_IGN);
-}
+        // EPOLLOUT tells the connect is done, either way
+        poller_.add_socket(sock, out.get(), true);
+        out->conn.reset(new connection(std::move(sock), std::move(addr), &poller_));
 
-server::~server()
-{
-}
+        dest.connections.push_back(std::move(out));
 
-const server& server::bind(std::string conn)
-{
-    conn_ctx_ = parse_connection_string(conn);
+        return dest.connections.back().get();
+    }
 
-    bind_addr_ = std::move(address(conn_ctx_.family, conn_ctx_.addr, conn_ctx_.port));
-    bind_sock_ = std::move(socket(conn_ctx_.family, conn_ctx_.type, conn_ctx_.protocol));
+    // Stale answers maybe: the next request resolves the host again
+    if (!dest.host.empty())
+    {
+        dest.candidates.clear();
+    }
 
-    bind_sock_.reuse();
+    fail(dest.waiting, "connect() exception: " + std::string(::strerror(errno)));
 
-    #ifdef BSD
-    int nosigpipe = 1;
-    int rc2 = ::setsockopt(bind_sock_, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(int));
-    if ( rc2 < 0 )
+    return 0;
+}
+
+void http_client::assign(outbound& out, request&& req)
+{
+    // Assigned from the handler of the last response, handle() resets the parser once that returns
+    if (out.in_flight.empty() && !out.delivering)
     {
-        throw std::runtime_error("Setting socket options SO_NOSIGPIPE failed.");
+        out.response.clear(req.head);
     }
-    #endif // BSD
-
 
-    int rc3 = ::bind(bind_sock_, bind_addr_, bind_addr_.size());
-    if (rc3 != 0)
+    // Still connecting: the requests go out once it is done
+    if (out.connected)
     {
-        throw std::runtime_error("Binding socket failed.");
+        out.conn->send(slice(req.bytes));
     }
 
-    return *this;
+    out.in_flight.push_back(std::move(req));
 }
 
-const server& server::listen() const
+size_t http_client::handle(outbound& out, epoll_state state)
 {
-    int rc = ::listen(bind_sock_, SOMAXCONN);
+    destination& dest = *out.dest;
+    size_t done = 0;
 
-    if (rc != 0)
+    if (!out.connected)
     {
-        throw std::runtime_error("Listening socket failed.");
-    }
+        int error = 0;
+        socklen_t size = sizeof(int);
+        ::getsockopt(out.conn->sock(), SOL_SOCKET, SO_ERROR, &error, &size);
 
-    return *this;
-}
+        if (error != 0)
+        {
+            // The next candidate gets the requests, none of them was sent. Another connection's
+            // refusal may have dropped the candidates already, they are looked up again then
+            if (!dest.candidates.empty())
+            {
+                dest.preferred = (out.candidate + 1) % dest.candidates.size();
+            }
 
-std::pair<socket, address> server::accept() const
-{
-    return accept(bind_sock_);
-}
+            dest.failures++;
 
-std::pair<socket, address> server::accept(const socket& sock_in) const
-{
-    sockaddr saddr;
-    socklen_t saddr_sz = sizeof(sockaddr);
-    socket sock_out(::accept(sock_in, &saddr, &saddr_sz));
-    address addr(saddr);
+            for (auto it = out.in_flight.rbegin(); it != out.in_flight.rend(); ++it)
+            {
+                dest.waiting.push_front(std::move(*it));
+            }
 
-    return std::make_pair(std::move(sock_out), std::move(addr));
-}
+            out.in_flight.clear();
+            retire(out, false, std::string());
 
-const server& server::accept_block(std::function<void(socket, address, std::mutex&)> fn) const
-{
-    std::atomic<bool> stop_cond(false);
+            // Every candidate refused in a row: give up on what waits instead of cycling through them again
+            if (dest.failures >= dest.candidates.size())
+            {
+                if (!dest.host.empty())
+                {
+                    dest.candidates.clear();
+                }
 
-    while ( !stop_cond )
-    {
-        std::shared_ptr<std::pair<socket, address>> pac =
-            std::make_shared<std::pair<socket, address>>
-            (
-                accept()
-            );
+                dest.failures = 0;
+                fail(dest.waiting, "connect() exception: " + std::string(::strerror(error)));
+            }
+
+            schedule(dest);
+            return 0;
+        }
+
+        out.connected = true;
+        dest.preferred = out.candidate;
+        dest.failures = 0;
 
-        fn(std::move(pac->first), std::move(pac->second), std::ref(iomutex_));
+        for (const request& req : out.in_flight)
+        {
+            out.conn->send(slice(req.bytes));
+        }
     }
 
-    return *this;
-}
+    bool eof = state == epoll_state::EPOLL_ERROR;
 
+    try
+    {
+        // Either event may hide behind the other, both directions are tried every time
+        out.conn->flush();
+        out.conn->receive();
+        eof = eof || out.conn->closed();
+    }
+    catch(std::exception& e)
+    {
+        retire(out, true, e.what());
+        schedule(dest);
+        return 0;
+    }
 
-const server& server::accept_async(std::function<void(socket, address, std::mutex&)> fn) const
-{
-    std::atomic<bool> stop_cond(false);
+    buffer& input = out.conn->input();
 
-    while ( !stop_cond )
+    while (!out.in_flight.empty())
     {
-        std::shared_ptr<std::pair<socket, address>> pac =
-            std::make_shared<std::pair<socket, address>>
-            (
-                accept()
-            );
+        parse_state rc = out.response.parse(input.data(), input.size(), eof);
 
-        std::thread worker([]
-            (std::function<void(socket, address, std::mutex&)> fn,
-             std::shared_ptr<std::pair<socket, address>> pac, std::mutex& m)
+        if (rc == parse_state::PARSE_INCOMPLETE)
         {
-            fn(std::move(pac->first), std::move(pac->second), std::ref(m));
-        }, std::ref(fn), pac, std::ref(iomutex_));
+            break;
+        }
 
-        if (worker.joinable())
+        if (rc == parse_state::PARSE_ERROR)
         {
-            worker.detach();
+            retire(out, false, "Malformed response.");
+            schedule(dest);
+            return done;
         }
-    }
 
-    return *this;
-}
+        const size_t length = out.response.length();
 
-const server& server::accept_epoll(std::function<void(socket, address, std::mutex&)> fn) const
-{
-    std::atomic<bool> stop_cond(false);
+        // 100 Continue and friends come ahead of the real response
+        if (out.response.status() < 200 && out.response.status() != 101)
+        {
+            input.consume(length);
+            out.response.clear(out.in_flight.front().head);
+            continue;
+        }
 
-    epoll ep;
-    bind_sock_.nonblocking();
-    ep.add_socket(bind_sock_);
+        request req = std::move(out.in_flight.front());
+        out.in_flight.pop_front();
 
-    while ( !stop_cond )
-    {
-        std::cerr << "epoll wait: ";
-        bool wt = ep.wait(1000);
-        std::cerr << "ok " << wt << std::endl;
+        out.reused = true;
+        out.closing = out.closing || !out.response.keep_alive();
+
+        // The handler may send again, a request assigned to this connection lands behind the ones in flight
+        out.delivering = true;
 
-        ep.dispatch([&](epoll_state state, const socket& sock)
+        try
         {
-            if (state == epoll_state::EPOLL_READ || state == epoll_state::EPOLL_WRITE)
-            {
-                std::cerr << "epoll accept for: ";
-                std::shared_ptr<std::pair<socket, address>> pac =
-                    std::make_shared<std::pair<socket, address>>
-                    (
-                        accept(sock)
-                    );
-                std::cerr << "ok" << std::endl;
+            req.fn(out.response, std::string());
+        }
+        catch(...)
+        {
+            // The response is still taken, the next one must not be read from its bytes
+            out.delivering = false;
+            input.consume(length);
+            out.response.clear(!out.in_flight.empty() && out.in_flight.front().head);
+            throw;
+        }
 
-                std::thread worker([]
-                    (std::function<void(socket, address, std::mutex&)> fn,
-                     std::shared_ptr<std::pair<socket, address>> pac, std::mutex& m)
-                {
-                    std::cerr << "epoll inside worker for: ";
-                    fn(std::move(pac->first), std::move(pac->second), std::ref(m));
-                    std::cerr << "ok" << std::endl;
-                }, std::ref(fn), pac, std::ref(iomutex_));
+        out.delivering = false;
+        done++;
 
-                if (worker.joinable())
-                {
-                    worker.detach();
-                }
-            }
-        });
+        input.consume(length);
+        out.response.clear(!out.in_flight.empty() && out.in_flight.front().head);
+
+        if (out.closing)
+        {
+            break;
+        }
     }
 
-    return *this;
+    if (out.closing || eof)
+    {
+        // Closed on requests that were sent: on a kept-alive connection they may just have met its
+        // timeout, the idempotent ones are tried again on a fresh connection
+        retire(out, true, "Connection closed.");
+    }
+    else if (out.in_flight.empty())
+    {
+        size_t idle = 0;
+        for (const auto& other : dest.connections)
+        {
+            idle += other->connected && !other->closing && other->in_flight.empty();
+        }
+
+        if (idle > max_idle_)
+        {
+            retire(out, false, std::string());
+        }
+    }
+
+    schedule(dest);
+
+    return done;
 }
 
-connection_info server::parse_connection_string(std::string conn) const
+void http_client::retire(outbound& out, bool retry, const std::string& error)
 {
-    connection_info connection;
-    connection.family = AF_INET;
-    connection.type = SOCK_STREAM;
-    connection.protocol = IPPROTO_TCP;
-    connection.port = 0;
-    connection.addr.s_addr = INADDR_ANY;
-
-    std::vector<std::string> conn_parts  = split_connection_string(conn);
+    destination& dest = *out.dest;
+    std::deque<request> failed;
 
-    if (conn_parts.size() <= 0 || conn_parts.size() > 3)
+    for (auto it = out.in_flight.rbegin(); it != out.in_flight.rend(); ++it)
     {
-        throw std::runtime_error("Invalid connection string.");
+        // On a fresh connection the close is no stale keep-alive but the server's answer
+        if (retry && out.reused && it->idempotent && !it->retried)
+        {
+            it->retried = true;
+            dest.waiting.push_front(std::move(*it));
+        }
+        else
+        {
+            failed.push_front(std::move(*it));
+        }
     }
 
-    std::string protocol = conn_parts[0];
-    std::string host = conn_parts[1];
-    std::string port = conn_parts[2];
+    out.in_flight.clear();
+    fail(failed, error);
+
+    poller_.remove_socket(out.conn->sock());
 
-    if (protocol == "tcp")
+    for (auto it = dest.connections.begin(); it != dest.connections.end(); ++it)
     {
-        connection.type = SOCK_STREAM;
-        connection.protocol = IPPROTO_TCP;
+        if (it->get() == &out)
+        {
+            retired_.push_back(std::move(*it));
+            dest.connections.erase(it);
+            break;
+        }
     }
-    else if (protocol == "udp")
+}
+
+void http_client::fail(std::deque<request>& requests, const std::string& error)
+{
+    for (request& req : requests)
     {
-        connection.type = SOCK_DGRAM;
-        connection.protocol = IPPROTO_UDP;
+        failed_.push_back(std::make_pair(std::move(req), error));
     }
-    else
+
+    requests.clear();
+}
+
+namespace util
+{
+    static std::set<int> ignored_errors = {EPIPE, ECONNRESET, EAGAIN};
+
+    bool is_ignored_error(int ec)
     {
-        throw std::runtime_error("Invalid protocol parameter.");
+        return (ignored_errors.find(ec) != ignored_errors.end());
     }
 
-    if (host.length() > 0)
+    static std::atomic<size_t> pool_allocations_(0);
+
+    void* pool_allocate(size_t size)
     {
-        addrinfo *infos;
-        addrinfo *info;
-        int rc = getaddrinfo(host.c_str(), NULL, NULL, &infos);
+        void* block = std::malloc(size);
 
-        if (rc != 0)
+        if (!block)
         {
-            throw std::runtime_error("Invalid host parameter.");
+            throw std::bad_alloc();
         }
 
-        for (info = infos; info != NULL; info = info->ai_next)
-        {
-            sockaddr_in* in = (sockaddr_in*)info->ai_addr;
-            connection.addr = in->sin_addr;
-            break; // Yes, break at 1st.
-        }
+        pool_allocations_++;
+
+        return block;
+    }
+
+    void pool_free(void* block)
+    {
+        std::free(block);
     }
 
-    std::istringstream strstream(port);
-    strstream >> connection.port;
+    size_t pool_allocations()
+    {
+        return pool_allocations_;
+    }
 
-    if (connection.port <= 0)
+    connection_info parse_connection_string(std::string conn)
     {
-        throw std::runtime_error("Invalid port parameter.");
+        connection_info connection;
+        resolve_connection_string(conn, connection);
+
+        return connection;
     }
 
-    return connection;
-}
+    std::vector<address> resolve_connection_string(std::string conn, connection_info& connection, resolver& names)
+    {
+        std::string host;
+        int family = AF_UNSPEC;
+        std::vector<address> candidates = parse_endpoint(conn, connection, host, family);
 
-std::vector<std::string> server::split_connection_string(std::string conn) const
-{
-    const std::string delimiter = ":";
-    std::vector<std::string> parts;
-    unsigned pos1 = 0, pos2 = 0;
+        if (candidates.empty())
+        {
+            candidates = names.resolve(host, connection.port, family, connection.type);
+            use_address(connection, candidates.front());
+        }
+
+        return candidates;
+    }
 
-    while(pos1 != std::string::npos && pos2 != std::string::npos)
+    std::vector<std::string> split_connection_string(std::string conn)
     {
-        if ( pos1 !=  std::string::npos)
+        const std::string delimiter = ":";
+        std::vector<std::string> parts;
+        std::string::size_type pos1 = 0, pos2 = 0;
+
+        // A unix path is taken as is, colons included
+        if (conn.compare(0, 5, "unix:") == 0 || conn.compare(0, 11, "unixpacket:") == 0)
         {
-            auto s = conn.begin() + pos1;
-            auto e = conn.end();
+            pos1 = conn.find(':');
+            parts.push_back(conn.substr(0, pos1));
+            parts.push_back(conn.substr(pos1 + 1));
+
+            return parts;
+        }
 
-            pos2 = conn.find_first_of(delimiter, pos1);
-            if ( pos2 != std::string::npos)
+        while(pos1 != std::string::npos && pos2 != std::string::npos)
+        {
+            if ( pos1 !=  std::string::npos)
             {
-                e = conn.begin() + pos2;
-            }
+                auto s = conn.begin() + pos1;
+                auto e = conn.end();
 
-            parts.push_back(std::string(s, e));
-            pos1 = pos2 + 1;
-        }
-    }
+                // "[::1]" keeps the colons of an IPv6 address inside the brackets
+                if (pos1 < conn.size() && conn[pos1] == '[')
+                {
+                    std::string::size_type close = conn.find(']', pos1);
+                    if (close == std::string::npos)
+                    {
+                        throw std::runtime_error("Invalid connection string.");
+                    }
+
+                    s = conn.begin() + pos1 + 1;
+                    e = conn.begin() + close;
+                    pos2 = close + 1 < conn.size() ? close + 1 : std::string::npos;
+
+                    if (pos2 != std::string::npos && conn[pos2] != ':')
+                    {
+                        throw std::runtime_error("Invalid connection string.");
+                    }
+
+                    parts.push_back(std::string(s, e));
+                    pos1 = pos2 + 1;
+                    continue;
+                }
 
-    return parts;
-}
+                pos2 = conn.find_first_of(delimiter, pos1);
+                if ( pos2 != std::string::npos)
+                {
+                    e = conn.begin() + pos2;
+                }
 
-namespace util
-{
-    static std::set<int> ignored_errors = {EPIPE, ECONNRESET, EAGAIN};
+                parts.push_back(std::string(s, e));
+                pos1 = pos2 + 1;
+            }
+        }
 
-    bool is_ignored_error(int ec)
-    {
-        return (ignored_errors.find(ec) != ignored_errors.end());
+        return parts;
     }
 } /* namespace util */
 
@@ -861,7 +6416,7 @@ std::istream& operator>> (std::istream &in, ha::socket &s)
     return in;
 }
 
-std::ostream& operator<< (std::ostream &out, ha::address &a)
+std::ostream& operator<< (std::ostream &out, const ha::address &a)
 {
     out << a.str();
     return out;
@@ -12,20 +12,30 @@
 #include <sstream>
 #include <cstring>
 #include <cstdlib>
+#include <cstddef>
 #include <cassert>
 #include <set>
 #include <list>
+#include <deque>
 #include <vector>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
 #include <string>
 #include <atomic>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <future>
 #include <chrono>
+#include <limits>
 #include <utility>
 #include <exception>
 #include <stdexcept>
 #include <algorithm>
 #include <functional>
+#include <initializer_list>
 
 #include <stdio.h>
 #include <fcntl.h>
@@ -34,11 +44,21 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/sendfile.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 namespace ha
 {
@@ -49,33 +69,383 @@ struct connection_info
     int type;       // SOCK_STREAM, SOCK_DGRAM, SOCK_RAW
     int protocol;   // IPPROTO_TCP, IPPROTO_UDP
 
-    int port;       // 0 - 65535
-    in_addr addr;   // INADDR_ANY
+    int port;               // 0 - 65535
+    sockaddr_storage addr;  // INADDR_ANY, in6addr_any, a resolved host or a unix path
+    socklen_t addr_size;
+};
+
+namespace util
+{
+    // General-purpose allocations made on behalf of slab and block_pool, process wide
+    void* pool_allocate(size_t size);
+    void pool_free(void* block);
+    size_t pool_allocations();
+
+    // C++11 stand-in for std::is_invocable, checks handler signatures at compile time
+    template <typename F, typename... A>
+    struct is_callable
+    {
+        private:
+            template <typename G>
+            static auto test(int) -> decltype(std::declval<G>()(std::declval<A>()...), std::true_type());
+            template <typename G>
+            static std::false_type test(...);
+
+        public:
+            static const bool value = decltype(test<F>(0))::value;
+    };
+} /* namespace util */
+
+// Fixed-size objects carved out of chunks and recycled through an intrusive free list.
+// Not thread-safe: a slab belongs to one reactor, so frees never cross threads
+template <typename T>
+class slab
+{
+    public:
+        static const size_t slab_chunk_hint = 64;
+
+        slab(size_t chunk = slab_chunk_hint)
+            : chunk_(std::max<size_t>(1, chunk)), chunks_(0), free_(0), live_(0), allocations_(0) { }
+
+        ~slab()
+        {
+            while (chunks_)
+            {
+                chunk* next = chunks_->next;
+                util::pool_free(chunks_);
+                chunks_ = next;
+            }
+        }
+
+        // No copy, no move
+        slab(const slab&) = delete;
+        slab(slab&&) = delete;
+        slab& operator=(const slab&) = delete;
+        slab& operator=(slab&&) = delete;
+
+        template <typename... A>
+        T* make(A&&... args)
+        {
+            if (!free_)
+            {
+                grow();
+            }
+
+            node* n = free_;
+            free_ = n->next;
+
+            try
+            {
+                T* object = new (&n->storage) T(std::forward<A>(args)...);
+                live_++;
+
+                return object;
+            }
+            catch(...)
+            {
+                n->next = free_;
+                free_ = n;
+                throw;
+            }
+        }
+
+        void destroy(T* object)
+        {
+            if (object)
+            {
+                object->~T();
+
+                node* n = reinterpret_cast<node*>(object);
+                n->next = free_;
+                free_ = n;
+                live_--;
+            }
+        }
+
+        size_t live() const { return live_; }
+        size_t allocations() const { return allocations_; }
+
+    private:
+        union node
+        {
+            node* next;
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        };
+
+        struct chunk
+        {
+            chunk* next;
+        };
+
+        static_assert(alignof(node) <= alignof(std::max_align_t), "slab: over-aligned type");
+
+        void grow()
+        {
+            const size_t header = (sizeof(chunk) + alignof(node) - 1) / alignof(node) * alignof(node);
+            unsigned char* block = static_cast<unsigned char*>(util::pool_allocate(header + chunk_ * sizeof(node)));
+
+            chunk* c = reinterpret_cast<chunk*>(block);
+            c->next = chunks_;
+            chunks_ = c;
+            allocations_++;
+
+            node* nodes = reinterpret_cast<node*>(block + header);
+            for (size_t i = chunk_; i > 0; i--)
+            {
+                nodes[i - 1].next = free_;
+                free_ = &nodes[i - 1];
+            }
+        }
+
+    private:
+        const size_t chunk_;
+        chunk* chunks_;
+        node* free_;
+        size_t live_;
+        size_t allocations_;
+};
+
+// Power-of-two blocks recycled through per-size free lists, owned by one thread
+class block_pool
+{
+    public:
+        static const size_t block_min_hint = 4096;
+        static const size_t block_classes_hint = 12;
+        static const size_t block_cache_hint = 1024;
+
+        block_pool(size_t cached = block_cache_hint);
+        virtual ~block_pool();
+
+        // No copy, no move
+        block_pool(const block_pool&) = delete;
+        block_pool(block_pool&&) = delete;
+        block_pool& operator=(const block_pool&) = delete;
+        block_pool& operator=(block_pool&&) = delete;
+
+        // Returns a block of at least size bytes, its usable size in capacity
+        unsigned char* acquire(size_t size, size_t& capacity);
+        void release(unsigned char* block, size_t capacity);
+
+        size_t allocations() const;
+
+    private:
+        static size_t size_class(size_t size);
+
+    private:
+        const size_t cached_;
+        std::vector<std::vector<unsigned char*>> free_;
+        size_t allocations_;
+};
+
+// Queue keeping its first entries inline, spilling to the heap only when they run out
+template <typename T, size_t N = 8>
+class fifo
+{
+    public:
+        fifo() : ring_(), head_(0), count_(0), overflow_() { }
+
+        bool empty() const { return size() == 0; }
+        size_t size() const { return count_ + overflow_.size(); }
+
+        T& front() { return ring_[head_]; }
+        const T& front() const { return ring_[head_]; }
+        T& back() { return overflow_.empty() ? ring_[(head_ + count_ - 1) % N] : overflow_.back(); }
+        T& operator[](size_t i) { return i < count_ ? ring_[(head_ + i) % N] : overflow_[i - count_]; }
+
+        void push_back(T&& item)
+        {
+            if (count_ < N && overflow_.empty())
+            {
+                ring_[(head_ + count_++) % N] = std::move(item);
+            }
+            else
+            {
+                overflow_.push_back(std::move(item));
+            }
+        }
+
+        void pop_front()
+        {
+            ring_[head_] = T();
+            head_ = (head_ + 1) % N;
+            count_--;
+
+            // Refill the ring in order once it drains
+            if (count_ == 0 && !overflow_.empty())
+            {
+                const size_t moved = std::min(N, overflow_.size());
+
+                for (size_t i = 0; i < moved; i++)
+                {
+                    ring_[(head_ + i) % N] = std::move(overflow_[i]);
+                }
+
+                overflow_.erase(overflow_.begin(), overflow_.begin() + moved);
+                count_ = moved;
+            }
+        }
+
+    private:
+        T ring_[N];
+        size_t head_;
+        size_t count_;
+        std::vector<T> overflow_;
+};
+
+class buffer
+{
+    public:
+        static const size_t buffer_size_hint = 8192;
+
+        buffer();
+        buffer(size_t capacity);
+        explicit buffer(block_pool* pool);
+        buffer(buffer&& other);
+        buffer& operator=(buffer&& other);
+        virtual ~buffer();
+
+        // No copy
+        buffer(const buffer&) = delete;
+        buffer& operator=(const buffer&) = delete;
+
+        const unsigned char* data() const;
+        size_t size() const;
+        bool empty() const;
+        size_t capacity() const;
+
+        // Reserves at least n writable bytes past the data, compacting before growing
+        unsigned char* prepare(size_t n);
+        size_t writable() const;
+        void commit(size_t n);
+
+        void consume(size_t n);
+        void clear();
+
+    private:
+        void reserve(size_t capacity);
+        void release();
+
+    private:
+        block_pool* pool_;
+        unsigned char* storage_;
+        size_t capacity_;
+        size_t head_;
+        size_t tail_;
+};
+
+// Non-owning view of bytes to be sent, the referenced memory must outlive the write
+class slice
+{
+    public:
+        slice();
+        slice(const void* data, size_t size);
+        slice(const std::string& str);
+        slice(const std::vector<unsigned char>& vec);
+        slice(const buffer& buf);
+
+        const unsigned char* data() const;
+        size_t size() const;
+
+    private:
+        const unsigned char* data_;
+        size_t size_;
+};
+
+// Non-owning view of characters, valid as long as the viewed storage
+class string_ref
+{
+    public:
+        string_ref();
+        string_ref(const char* data, size_t size);
+        string_ref(const char* str);
+        string_ref(const std::string& str);
+
+        const char* data() const;
+        size_t size() const;
+        bool empty() const;
+        std::string str() const;
+
+        bool equals(const string_ref& other) const;
+        bool iequals(const string_ref& other) const;
+        bool icontains(const string_ref& token) const;
+
+    private:
+        const char* data_;
+        size_t size_;
+};
+
+// Open descriptor and stat() snapshot of a file, closed with the last reference
+class cached_file
+{
+    public:
+        cached_file(int fd, const struct stat& st);
+        virtual ~cached_file();
+
+        // No copy, no move
+        cached_file(const cached_file&) = delete;
+        cached_file(cached_file&&) = delete;
+        cached_file& operator=(const cached_file&) = delete;
+        cached_file& operator=(cached_file&&) = delete;
+
+        int fd() const;
+        off_t size() const;
+        const struct stat& stat() const;
+
+        bool same(const struct stat& st) const;
+
+    private:
+        int fd_;
+        struct stat stat_;
 };
 
 class socket
 {
     public:
+        static const size_t descriptors_hint = 16;
+        // Most a single read_into() takes in, a fast sender must not starve the rest of a reactor
+        static const size_t read_budget_hint = 256 * 1024;
+
         socket();
         socket(int domain, int type, int protocol);
         socket(int socket);
         socket(const socket& other);
-        socket(socket&& other);
+        socket(socket&& other) noexcept;
         virtual ~socket();
 
         std::vector<unsigned char> read() const;
+        size_t read_into(buffer& buf) const;
+        size_t read_into(buffer& buf, bool& closed, size_t budget = read_budget_hint) const;
         size_t write(const unsigned char* buffer, size_t size) const;
         size_t write(const std::vector<unsigned char>& buffer) const;
         size_t write(const std::string& buffer) const;
+        size_t writev(const slice* slices, size_t count, bool more = false) const;
+        size_t writev(const std::vector<slice>& slices, bool more = false) const;
+        size_t writev(std::initializer_list<slice> slices, bool more = false) const;
         size_t write_file(std::string filename) const;
+        size_t write_file(int fd, off_t& offset, size_t count) const;
+        size_t write_file(const cached_file& file, off_t& offset) const;
+
+        // Unix sockets only: descriptors ride along with data as SCM_RIGHTS, at least one byte must go with them.
+        // Received descriptors are close-on-exec and owned by the sockets appended to fds
+        size_t send_descriptors(const slice& data, const int* fds, size_t count) const;
+        size_t send_descriptors(const slice& data, const std::vector<int>& fds) const;
+        size_t receive_descriptors(unsigned char* data, size_t size, std::vector<socket>& fds,
+                                   size_t max = descriptors_hint) const;
+
+        // Bytes already queued for reading
+        size_t available() const;
 
         void reuse() const;
+        void reuse_port() const;
         void nonblocking() const;
+        void cork(bool enable) const;
 
         void close();
+        void abort();
+        int release();
 
         socket& operator=(const socket&);
-        socket& operator=(socket&&);
+        socket& operator=(socket&&) noexcept;
 
         int operator=(int);
 
@@ -90,27 +460,45 @@ class address
 {
     public:
         address();
+        address(const sockaddr* saddr, socklen_t size);
         address(sockaddr saddr);
         address(short family, in_addr addr, unsigned short port);
+        address(const in6_addr& addr, unsigned short port);
+        // Numeric IPv4 or IPv6 host
         address(std::string addr, unsigned short port);
         address(const address& other);
-        address(address&& other);
+        address(address&& other) noexcept;
         virtual ~address();
 
+        // Unix domain socket: a filesystem path, or an abstract name written "@name"
+        static address local(const std::string& path);
+
+        int family() const;
+        unsigned short port() const;
         std::string str() const;
         socklen_t size() const;
 
         address& operator=(const address&);
-        address& operator=(address&&);
+        address& operator=(address&&) noexcept;
+
+        bool operator==(const address& other) const;
+        bool operator!=(const address& other) const;
 
-        operator const sockaddr() const;
         operator const sockaddr*() const;
 
-        operator const sockaddr_in() const;
-        operator const sockaddr_in*() const;
+    private:
+        void assign(const sockaddr* saddr, socklen_t size);
 
     private:
-        sockaddr sockaddr_;
+        // IPv4 and IPv6 stay inline, only a named unix address needs the full storage
+        union
+        {
+            sockaddr sa;
+            sockaddr_in in;
+            sockaddr_in6 in6;
+        } inline_;
+        std::unique_ptr<sockaddr_storage> storage_;
+        socklen_t size_;
 };
 
 class mutex
@@ -161,6 +549,45 @@ class scoped_resource
         T resource_;
 };
 
+class file_cache
+{
+    public:
+        typedef std::shared_ptr<const cached_file> file_t;
+
+        static const size_t file_cache_size_hint = 256;
+
+        file_cache(size_t capacity = file_cache_size_hint, unsigned long revalidate_ms = 1000);
+        virtual ~file_cache();
+
+        // No copy, no move
+        file_cache(const file_cache&) = delete;
+        file_cache(file_cache&&) = delete;
+        file_cache& operator=(const file_cache&) = delete;
+        file_cache& operator=(file_cache&&) = delete;
+
+        file_t get(const std::string& path);
+        void invalidate(const std::string& path);
+        void clear();
+        size_t size() const;
+
+    private:
+        struct node
+        {
+            std::string path;
+            file_t file;
+            std::chrono::steady_clock::time_point checked;
+        };
+
+        typedef std::list<node> lru_t;
+
+    private:
+        const size_t capacity_;
+        const std::chrono::milliseconds revalidate_;
+        lru_t lru_;
+        std::unordered_map<std::string, lru_t::iterator> index_;
+        mutable std::mutex mutex_;
+};
+
 enum class epoll_state
 {
     EPOLL_READ,
@@ -173,26 +600,699 @@ enum class epoll_state
 class epoll
 {
     public:
-        epoll();
+        static const size_t epoll_queue_size_hint = 1024;
+
+        epoll(size_t max_events = epoll_queue_size_hint);
         virtual ~epoll();
 
-        const epoll& add_socket(const socket& sock);
+        // No copy, no move
+        epoll(const epoll&) = delete;
+        epoll(epoll&&) = delete;
+        epoll& operator=(const epoll&) = delete;
+        epoll& operator=(epoll&&) = delete;
+
+        const epoll& add_socket(const socket& sock, void* data = 0, bool want_write = true);
         const epoll& remove_socket(const socket& sock);
+        const epoll& want_write(const socket& sock, bool enable);
+        // Reports a socket again on the next wait if it is still ready, for handlers stopping short of EAGAIN
+        const epoll& rearm(const socket& sock);
 
         bool wait(unsigned long ms = 0);
-        size_t dispatch(std::function<void(epoll_state, const socket&)> fn) const;
+        size_t ready() const;
+        size_t dispatch(const std::function<void(epoll_state, const socket&)>& fn) const;
+        size_t dispatch(const std::function<void(epoll_state, const socket&, void*)>& fn) const;
+
+        // Any callable taking (epoll_state, const socket&[, void*]), invoked without type erasure
+        template <typename F>
+        size_t dispatch(F&& fn) const
+        {
+            typedef util::is_callable<F&, epoll_state, const socket&, void*> with_data;
+
+            static_assert(with_data::value || util::is_callable<F&, epoll_state, const socket&>::value,
+                    "epoll::dispatch() handler must take (epoll_state, const socket&[, void*])");
+
+            for (size_t i = 0; i < ready_; i++)
+            {
+                const struct epoll_event& ev = wait_events_[i];
+                const registration* reg = static_cast<const registration*>(ev.data.ptr);
+
+                if (reg->fd < 0)
+                {
+                    continue;
+                }
+
+                // Borrow the descriptor: the temporary must not close it
+                socket sock(reg->fd);
+
+                try
+                {
+                    invoke(fn, state(ev.events), sock, reg->data, std::integral_constant<bool, with_data::value>());
+                }
+                catch(...)
+                {
+                    sock.release();
+                    throw;
+                }
+
+                sock.release();
+            }
+
+            return ready_;
+        }
 
     private:
-        static const size_t epoll_queue_size_hint = 1024;
+        template <typename F>
+        static void invoke(F& fn, epoll_state state, const socket& sock, void* data, std::true_type)
+        {
+            fn(state, sock, data);
+        }
 
+        template <typename F>
+        static void invoke(F& fn, epoll_state state, const socket& sock, void*, std::false_type)
+        {
+            fn(state, sock);
+        }
+
+        // Kept alive at a stable address, epoll_event.data.ptr points here
+        struct registration
+        {
+            int fd;
+            void* data;
+            uint32_t events;
+        };
+
+        static epoll_state state(uint32_t events);
+
+    private:
         int epollfd_;
-        std::vector<struct epoll_event> epoll_events_;
+        size_t ready_;
+        slab<registration> slab_;
+        std::vector<registration*> registrations_;
+        std::vector<registration*> retired_;
+        size_t registered_;
         std::vector<struct epoll_event> wait_events_;
 };
 
+enum class engine
+{
+    ENGINE_EPOLL,
+    ENGINE_URING
+};
+
+// Raw io_uring instance: operations are queued and submitted in one go by wait()
+class uring
+{
+    public:
+        static const unsigned uring_queue_size_hint = 1024;
+
+        uring(unsigned entries = uring_queue_size_hint);
+        virtual ~uring();
+
+        // No copy, no move
+        uring(const uring&) = delete;
+        uring(uring&&) = delete;
+        uring& operator=(const uring&) = delete;
+        uring& operator=(uring&&) = delete;
+
+        void accept(const socket& listener, int flags, uint64_t tag);
+        // Multishot keeps receiving into provided buffers until the completion without IORING_CQE_F_MORE
+        void recv(const socket& sock, uint16_t group, uint64_t tag, bool multishot = true);
+        void send(const socket& sock, const void* data, size_t size, int flags, uint64_t tag);
+        void splice(int fd_in, int64_t off_in, int fd_out, size_t size, uint64_t tag, unsigned sqe_flags = 0);
+        void poll(const socket& sock, unsigned events, uint64_t tag, unsigned sqe_flags = 0);
+        void close(int fd, uint64_t tag);
+        void cancel(uint64_t target, uint64_t tag);
+        void provide_buffers(void* base, unsigned size, unsigned count, uint16_t group, uint16_t id, uint64_t tag);
+
+        // Submits queued operations and waits for at least one completion
+        size_t wait(unsigned long ms = 0);
+        size_t dispatch(const std::function<void(const io_uring_cqe&)>& fn);
+
+        template <typename F>
+        size_t dispatch(F&& fn)
+        {
+            static_assert(util::is_callable<F&, const io_uring_cqe&>::value,
+                    "uring::dispatch() handler must take (const io_uring_cqe&)");
+
+            unsigned head = *cq_head_;
+            const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            size_t count = 0;
+
+            while (head != tail)
+            {
+                // Copy out and release the slot first, fn may queue more work
+                const io_uring_cqe cqe = cqes_[head & cq_mask_];
+                __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+
+                fn(cqe);
+                count++;
+            }
+
+            return count;
+        }
+
+    private:
+        io_uring_sqe* sqe(uint8_t opcode, int fd, uint64_t tag);
+        int enter(unsigned submit, unsigned complete, unsigned flags, unsigned long ms);
+        void submit();
+        void release();
+
+    private:
+        int ringfd_;
+        unsigned features_;
+
+        void* sq_ptr_;
+        size_t sq_size_;
+        void* cq_ptr_;
+        size_t cq_size_;
+        io_uring_sqe* sqes_;
+        size_t sqes_size_;
+
+        unsigned* sq_head_;
+        unsigned* sq_tail_;
+        unsigned* sq_array_;
+        unsigned sq_mask_;
+        unsigned sq_entries_;
+        unsigned sq_local_tail_;
+        unsigned sq_submitted_;
+
+        unsigned* cq_head_;
+        unsigned* cq_tail_;
+        io_uring_cqe* cqes_;
+        unsigned cq_mask_;
+};
+
+enum class pool_policy
+{
+    POOL_BLOCK,     // Wait for a free slot, stalls accept
+    POOL_SHED,      // Reset the connection
+    POOL_INLINE     // Run the task on the submitting thread
+};
+
+class thread_pool
+{
+    public:
+        typedef std::function<void()> task_t;
+
+        thread_pool(size_t workers = 0, size_t queue_bound = 1024);
+        virtual ~thread_pool();
+
+        // No copy, no move
+        thread_pool(const thread_pool&) = delete;
+        thread_pool(thread_pool&&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+        thread_pool& operator=(thread_pool&&) = delete;
+
+        bool try_submit(task_t task);
+        void submit(task_t task);
+
+        size_t size() const;
+        size_t pending() const;
+
+    private:
+        struct worker_queue
+        {
+            std::mutex mutex;
+            std::deque<task_t> tasks;
+        };
+
+        bool reserve();
+        void push(task_t&& task);
+        bool pop(size_t index, task_t& task);
+        void run(size_t index);
+
+    private:
+        const size_t bound_;
+        std::vector<std::unique_ptr<worker_queue>> queues_;
+        std::vector<std::thread> workers_;
+        std::atomic<size_t> reserved_;
+        std::atomic<size_t> queued_;
+        std::atomic<size_t> waiting_;
+        std::atomic<size_t> next_;
+        std::atomic<bool> stop_;
+        std::mutex wait_mutex_;
+        std::condition_variable work_cond_;
+        std::condition_variable space_cond_;
+};
+
+enum class metric
+{
+    METRIC_ACCEPTS,
+    METRIC_ACCEPT_DROPS,    // Connections closed unserved, accepted only to keep the backlog moving
+    METRIC_EAGAINS,         // Reads, writes and accepts the kernel turned away
+    METRIC_TRUNCATED,       // Datagrams larger than their receive slot, dropped
+    METRIC_SHORT_WRITES,    // Writes that took less than offered
+    METRIC_SENDFILE_BYTES,
+    METRIC_WAKEUPS,         // Returns from epoll_wait() or io_uring_enter()
+    METRIC_EVENTS,          // Events or completions reported by those wakeups
+    METRIC_COUNT
+};
+
+enum class latency
+{
+    LATENCY_FIRST_BYTE,     // Accept to the first byte read
+    LATENCY_REQUEST,        // Request parse start to handler return
+    LATENCY_WRITE,          // Output queued by a short write until fully sent
+    LATENCY_COUNT
+};
+
+// Log-linear histogram in the HDR style: each power of two is split into
+// 2^histogram_sub_bits_hint linear buckets, a percentile is off by at most 1/32
+class histogram
+{
+    public:
+        static const unsigned histogram_sub_bits_hint = 5;
+        static const size_t histogram_buckets_hint = (64 - histogram_sub_bits_hint + 1) << histogram_sub_bits_hint;
+
+        histogram();
+
+        void record(uint64_t value, uint64_t count = 1);
+        void merge(const histogram& other);
+
+        uint64_t count() const;
+        uint64_t max() const;
+        double mean() const;
+        // Highest value of the bucket holding the q-th fraction of samples, q in [0, 1]
+        uint64_t percentile(double q) const;
+
+        static size_t bucket(uint64_t value);
+        static uint64_t bucket_max(size_t bucket);
+
+    private:
+        friend class reactor_metrics;
+
+        std::vector<uint64_t> counts_;
+        uint64_t count_;
+        uint64_t sum_;
+        uint64_t max_;
+};
+
+class metrics_snapshot;
+
+// Instrumentation shard of one reactor thread. Only that thread writes, with relaxed
+// loads and stores instead of locked increments, snapshots read it from anywhere
+class reactor_metrics
+{
+    public:
+        reactor_metrics();
+
+        // No copy, no move
+        reactor_metrics(const reactor_metrics&) = delete;
+        reactor_metrics(reactor_metrics&&) = delete;
+        reactor_metrics& operator=(const reactor_metrics&) = delete;
+        reactor_metrics& operator=(reactor_metrics&&) = delete;
+
+        // Shard of the calling thread, null outside reactors: instrumentation is skipped then
+        static reactor_metrics* current();
+
+        void count(metric m, uint64_t n = 1);
+        void record(latency l, std::chrono::steady_clock::duration elapsed);
+
+        void snapshot(metrics_snapshot& into) const;
+
+        // Makes a shard current() for the calling thread while in scope
+        class scope
+        {
+            public:
+                explicit scope(reactor_metrics* shard);
+                ~scope();
+
+                // No copy, no move
+                scope(const scope&) = delete;
+                scope(scope&&) = delete;
+                scope& operator=(const scope&) = delete;
+                scope& operator=(scope&&) = delete;
+
+            private:
+                reactor_metrics* previous_;
+        };
+
+    private:
+        static thread_local reactor_metrics* current_;
+
+        static const size_t metric_count = static_cast<size_t>(metric::METRIC_COUNT);
+        static const size_t latency_count = static_cast<size_t>(latency::LATENCY_COUNT);
+
+        std::atomic<uint64_t> counters_[metric_count];
+        std::atomic<uint64_t> buckets_[latency_count][histogram::histogram_buckets_hint];
+        std::atomic<uint64_t> sums_[latency_count];
+        std::atomic<uint64_t> maxes_[latency_count];
+};
+
+// Every reactor's shard merged, latencies in nanoseconds
+class metrics_snapshot
+{
+    public:
+        metrics_snapshot();
+
+        uint64_t count(metric m) const;
+        const histogram& latencies(latency l) const;
+        double events_per_wakeup() const;
+
+        // One "name value" line per counter, count, mean, p50, p99, p999 and max per latency
+        std::string str() const;
+
+    private:
+        friend class reactor_metrics;
+
+        std::vector<uint64_t> counters_;
+        std::vector<histogram> latencies_;
+};
+
+// Serialized response: head with any small body inline, large bodies as a sealed file
+class cached_response
+{
+    public:
+        cached_response(std::string&& head, const file_cache::file_t& body);
+
+        const std::string& head() const;
+        const file_cache::file_t& body() const;
+        size_t size() const;
+
+    private:
+        const std::string head_;
+        const file_cache::file_t body_;
+};
+
+class response_cache
+{
+    public:
+        typedef std::shared_ptr<const cached_response> response_t;
+        typedef std::vector<std::pair<std::string, std::string>> headers_t;
+
+        // Stable place to load the current rendering from. The shared_ptr is copied with std::atomic_load,
+        // which in libstdc++ briefly takes one of a pool of mutexes picked by address: never held across
+        // I/O, but not lock-free
+        class slot
+        {
+            public:
+                response_t load() const;
+
+            private:
+                friend class response_cache;
+
+                int status_;
+                headers_t headers_;
+                std::string body_;
+                file_cache::file_t file_;
+                bool date_;
+                response_t current_;
+        };
+
+        typedef std::shared_ptr<const slot> slot_t;
+
+        static const size_t response_inline_limit = 16 * 1024;
+
+        response_cache(unsigned long refresh_ms = 0);
+        virtual ~response_cache();
+
+        // No copy, no move
+        response_cache(const response_cache&) = delete;
+        response_cache(response_cache&&) = delete;
+        response_cache& operator=(const response_cache&) = delete;
+        response_cache& operator=(response_cache&&) = delete;
+
+        slot_t add(const std::string& key, int status, const headers_t& headers,
+                const std::string& body, bool date = false);
+        slot_t add_file(const std::string& key, int status, const headers_t& headers,
+                const std::string& path, bool date = false);
+
+        slot_t find(const std::string& key) const;
+        response_t get(const std::string& key) const;
+
+        // Re-renders responses carrying a Date header
+        void refresh();
+        size_t size() const;
+
+    private:
+        slot_t insert(const std::string& key, std::shared_ptr<slot>&& entry);
+        static response_t render(const slot& entry, const std::string& date);
+        static std::string http_date();
+
+    private:
+        std::unordered_map<std::string, std::shared_ptr<slot>> slots_;
+        mutable std::mutex mutex_;
+        std::atomic<bool> stop_;
+        std::condition_variable stop_cond_;
+        std::thread refresher_;
+};
+
+class connection
+{
+    public:
+        static const size_t low_watermark_hint = 64 * 1024;
+        static const size_t high_watermark_hint = 1024 * 1024;
+
+        connection(socket&& sock, address&& addr, epoll* poller = 0, block_pool* pool = 0);
+        virtual ~connection();
+
+        // No copy, no move
+        connection(const connection&) = delete;
+        connection(connection&&) = delete;
+        connection& operator=(const connection&) = delete;
+        connection& operator=(connection&&) = delete;
+
+        // Only ever touched by the reactor thread that accepted it, no locking needed
+        const socket& sock() const;
+        const address& addr() const;
+        buffer& input();
+
+        // Reads everything available into input(), closes on EOF
+        size_t receive();
+
+        // Writes what the socket takes now, queues the rest and arms EPOLLOUT
+        size_t send(const slice& data);
+        size_t send(std::initializer_list<slice> data);
+        size_t send_file(const file_cache::file_t& file, off_t offset, size_t count);
+        size_t send_file(const file_cache::file_t& file);
+        size_t send(const std::shared_ptr<const cached_response>& response);
+
+        // Drains the queue as far as the socket allows, true when empty
+        bool flush();
+        size_t pending() const;
+
+        // Above high the application should stop producing until a write event
+        void watermarks(size_t low, size_t high);
+        bool congested() const;
+        bool resumed();
+
+        // Marks the connection, its reactor releases it once the queue is flushed
+        void close();
+        bool closed() const;
+
+        // Per-connection user state, created on first access
+        template <typename T>
+        T& state()
+        {
+            if (!state_)
+            {
+                state_ = std::make_shared<T>();
+            }
+
+            return *static_cast<T*>(state_.get());
+        }
+
+    private:
+        // Queued bytes live in output_ in order, shared blocks are referenced in place
+        // and file ranges are sent with sendfile()
+        struct segment
+        {
+            size_t remaining;
+            off_t offset;
+            file_cache::file_t file;
+            std::shared_ptr<const void> hold;
+            const unsigned char* data;
+        };
+
+        void enqueue(const slice& data);
+        void enqueue(const std::shared_ptr<const void>& hold, const slice& data);
+        const unsigned char* bytes(const segment& seg) const;
+        // Completion engines send straight from the queue while the handler may queue more:
+        // moves the bytes queued so far out of output_, where growing it can no longer move them
+        void seal();
+        void consumed(size_t n);
+        void arm();
+        void received(size_t n);
+        void queued();
+
+        // Reactors drive the queue directly
+        friend class server;
+
+    private:
+        socket socket_;
+        address address_;
+        epoll* poller_;
+        buffer input_;
+        buffer output_;
+        buffer sealed_;
+        fifo<segment> queue_;
+        size_t pending_;
+        size_t low_watermark_;
+        size_t high_watermark_;
+        bool congested_;
+        bool deferred_;
+        std::shared_ptr<void> state_;
+        bool closed_;
+        // Only taken inside instrumented reactors, reset once recorded
+        std::chrono::steady_clock::time_point accepted_;
+        std::chrono::steady_clock::time_point queued_;
+};
+
+enum class parse_state
+{
+    PARSE_INCOMPLETE,
+    PARSE_COMPLETE,
+    PARSE_ERROR
+};
+
+struct http_header
+{
+    string_ref name;
+    string_ref value;
+};
+
+// HTTP/1.x request head parser, every field is a view into the parsed bytes
+class http_request
+{
+    public:
+        static const size_t http_head_limit = 64 * 1024;
+        // A larger Content-Length is a parse error, the body would otherwise pile up in the input
+        static const size_t http_body_limit = 8 * 1024 * 1024;
+        static const size_t http_headers_hint = 32;
+
+        http_request();
+
+        // Parses one request from the front of data; call again with more data
+        // (same start, longer size) while it reports PARSE_INCOMPLETE
+        parse_state parse(const unsigned char* data, size_t size);
+        void clear();
+
+        string_ref method() const;
+        string_ref target() const;
+        int version() const;
+        const std::vector<http_header>& headers() const;
+        string_ref header(const string_ref& name) const;
+        string_ref body() const;
+
+        // Bytes taken by head and body, to be consumed from the input
+        size_t length() const;
+        bool keep_alive() const;
+
+    private:
+        parse_state parse_head(const char* data, size_t size);
+
+    private:
+        size_t scanned_;
+        size_t head_length_;
+        size_t content_length_;
+        string_ref method_;
+        string_ref target_;
+        int version_;
+        std::vector<http_header> headers_;
+        string_ref body_;
+        bool keep_alive_;
+};
+
+// HTTP/1.x response parser for clients, views into the parsed bytes like http_request.
+// A body without Content-Length runs until the connection closes
+class http_response
+{
+    public:
+        // Bodies from a backend may be larger than requests, but still not without end
+        static const size_t http_body_limit = 64 * 1024 * 1024;
+
+        http_response();
+
+        // As http_request::parse(); closed tells the peer is gone, which ends a body delimited by close
+        parse_state parse(const unsigned char* data, size_t size, bool closed = false);
+        // The next response answers a HEAD request: no body whatever the headers say
+        void clear(bool head = false);
+
+        int status() const;
+        string_ref reason() const;
+        int version() const;
+        const std::vector<http_header>& headers() const;
+        string_ref header(const string_ref& name) const;
+        string_ref body() const;
+
+        size_t length() const;
+        bool keep_alive() const;
+
+    private:
+        parse_state parse_head(const char* data, size_t size);
+
+    private:
+        size_t scanned_;
+        size_t head_length_;
+        size_t content_length_;
+        int status_;
+        string_ref reason_;
+        int version_;
+        std::vector<http_header> headers_;
+        string_ref body_;
+        bool keep_alive_;
+        bool head_;
+        bool until_close_;
+};
+
+// One received datagram, data points into the reactor's receive arena and is only
+// valid while the handler runs
+struct datagram
+{
+    slice data;
+    address peer;
+};
+
+// Replies a datagram handler queues for its batch, copied aside and sent together with
+// sendmmsg() once the handler returns
+class datagram_queue
+{
+    public:
+        // UDP_SEGMENT limits: segments per send and bytes per send
+        static const size_t datagram_segments_hint = 64;
+        static const size_t datagram_segment_bytes_hint = 65000;
+
+        datagram_queue();
+
+        // No copy, no move
+        datagram_queue(const datagram_queue&) = delete;
+        datagram_queue(datagram_queue&&) = delete;
+        datagram_queue& operator=(const datagram_queue&) = delete;
+        datagram_queue& operator=(datagram_queue&&) = delete;
+
+        void send(const address& peer, const slice& data);
+        size_t size() const;
+        void clear();
+
+    private:
+        friend class server;
+
+        struct entry
+        {
+            address peer;
+            size_t offset;
+            size_t size;
+        };
+
+        // Runs of equal sized replies to one peer leave as a single GSO send when segment is set
+        size_t flush(const socket& sock, bool segment);
+
+    private:
+        std::vector<unsigned char> arena_;
+        std::vector<entry> entries_;
+        std::vector<struct iovec> iov_;
+        std::vector<struct mmsghdr> headers_;
+        std::vector<char> control_;
+};
+
 class server
 {
     public:
+        static const unsigned long stop_deadline_hint = 5000;
+        // Largest UDP payload: a datagram_size slot takes any datagram in whole
+        static const size_t datagram_size_hint = 65535;
+        static constexpr const char* listener_variable_hint = "HENET_LISTENER_FD";
+
         server();
         virtual ~server();
 
@@ -202,47 +1302,918 @@ class server
         server& operator=(const server&) = delete;
         server& operator=(server&&) = delete;
 
-        const server& bind(std::string conn);
+        // A second bind to a busy port fails unless both opt in with reuse_port: then each
+        // reactor gets its own SO_REUSEPORT twin, otherwise the reactors share the one listener
+        const server& bind(std::string conn, bool reuse_port = false);
         const server& listen() const;
+
+        // Listener handoff for restarts without refused connections: the new process adopts the
+        // socket still queueing connections instead of binding, the old one then drains (stop())
+        // Takes fd over once it checks out as a listener, on an exception the caller still owns it
+        const server& adopt(int fd);
+        // Adopts the listeners another process passes over the unix socket at path, false when none does.
+        // SO_REUSEPORT twins coming along are served too, each by a reactor or the accept loop
+        bool adopt_from(const std::string& path);
+        // Adopts the descriptor named in the environment by inherit(), false when there is none
+        bool adopt_inherited(const std::string& variable = listener_variable_hint);
+        // Passes the listener and its twins to the first process connecting at path, then stops in the
+        // background. They are never shut down: what queues after the last accept is the successor's
+        const server& share(const std::string& path, unsigned long deadline_ms = stop_deadline_hint);
+        // Keeps the listener open across exec() and names it in the environment for the child
+        const server& inherit(const std::string& variable = listener_variable_hint);
+
+        // Thread per connection loops. Every handler taking a mutex gets the same one, for state shared
+        // across connections; a connection is only served by one thread, a handler of (socket, address) needs none
         const server& accept_block(std::function<void(socket, address, std::mutex&)> fn) const;
         const server& accept_async(std::function<void(socket, address, std::mutex&)> fn) const;
         const server& accept_epoll(std::function<void(socket, address, std::mutex&)> fn) const;
+        const server& accept_reactors(std::function<void(socket, address, std::mutex&)> fn, size_t reactors = 0) const;
+        const server& accept_events(std::function<void(epoll_state, connection&)> fn, size_t reactors = 1,
+                engine kind = engine::ENGINE_EPOLL) const;
+        const server& accept_http(std::function<void(const http_request&, connection&)> fn, size_t reactors = 1,
+                engine kind = engine::ENGINE_EPOLL) const;
+        const server& accept_pool(std::function<void(socket, address, std::mutex&)> fn, thread_pool& pool,
+                pool_policy policy = pool_policy::POOL_BLOCK) const;
+
+        // Datagram sockets, bind("udp::port"): batches arrive through recvmmsg(), replies leave through
+        // sendmmsg(). With reuse_port every reactor gets its own socket, offload turns on UDP GRO and GSO.
+        // Every reactor keeps a batch of datagram_size slots, larger datagrams are dropped and counted
+        const server& serve_datagrams(std::function<void(const std::vector<datagram>&, datagram_queue&)> fn,
+                size_t reactors = 1, bool offload = false, size_t datagram_size = datagram_size_hint) const;
+
+        // Stops accepting, lets open connections finish until the deadline and closes the rest,
+        // the accept loops then return. Only touches atomics and an eventfd: safe from a signal handler
+        const server& stop(unsigned long deadline_ms = stop_deadline_hint);
+        bool stopped() const;
+
+        // Counters and latency histograms of every reactor run so far, merged without stalling them
+        metrics_snapshot metrics() const;
+
+        // Same loops for any callable, the handler is inlined into the reactor instead of
+        // being called through std::function; the overloads above forward here
+        template <typename F>
+        const server& accept_block(F fn) const;
+        template <typename F>
+        const server& accept_async(F fn) const;
+        template <typename F>
+        const server& accept_epoll(F fn) const;
+        template <typename F>
+        const server& accept_reactors(F fn, size_t reactors = 0) const;
+        template <typename F>
+        const server& accept_events(F fn, size_t reactors = 1, engine kind = engine::ENGINE_EPOLL) const;
+        template <typename F>
+        const server& accept_http(F fn, size_t reactors = 1, engine kind = engine::ENGINE_EPOLL) const;
+        template <typename F>
+        const server& serve_datagrams(F fn, size_t reactors = 1, bool offload = false,
+                size_t datagram_size = datagram_size_hint) const;
 
     private:
-        connection_info parse_connection_string(std::string conn) const;
-        std::vector<std::string> split_connection_string(std::string conn) const;
+        // Connections served on their own threads; shared with those threads, so one
+        // outliving the deadline never touches a finished accept loop
+        struct tracker
+        {
+            std::mutex mutex;
+            std::condition_variable idle;
+            size_t active;
+            // Duplicates of the live sockets: a handler closing its own leaves the number to reuse
+            std::set<int> live;
+
+            tracker() : mutex(), idle(), active(0), live() { }
+
+            // The handle to leave with, -1 when out of descriptors: counted but never shut down
+            int enter(const socket& sock);
+            void leave(int handle);
+            // Past the deadline the remaining sockets are shut down, their handlers see the peer gone
+            bool wait_until(std::chrono::steady_clock::time_point deadline);
+
+            // Leaves on scope exit, so a throwing handler still counts as gone
+            struct guard
+            {
+                tracker& owner;
+                int handle;
+
+                guard(tracker& t, int h) : owner(t), handle(h) { }
+                ~guard() { owner.leave(handle); }
+
+                guard(const guard&) = delete;
+                guard& operator=(const guard&) = delete;
+            };
+        };
+
+        typedef std::shared_ptr<tracker> tracker_t;
+
+    private:
+        socket make_listener() const;
+        void spawn_reactors(size_t reactors, const std::function<void(const socket&)>& loop) const;
+        // Ready listeners, the bound one and its twins, false once stopping
+        bool wait_accept(std::vector<const socket*>& ready) const;
+        // Accepts whatever is already queued; the listener stays open, a successor holding it takes the rest
+        void take_backlog(const socket& listener, std::vector<std::pair<socket, address>>& batch) const;
+        void take_backlog(std::vector<std::pair<socket, address>>& batch) const;
+        // New shard for a reactor thread, kept for snapshots as long as the server lives
+        reactor_metrics* attach_metrics() const;
+        void hand_off(int unix_fd, std::string path, unsigned long deadline_ms);
+        std::chrono::steady_clock::time_point deadline() const;
+        unsigned long remaining_ms() const;
+        template <typename F>
+        void run_reactor(const socket& listener, const std::shared_ptr<F>& fn, const tracker_t& connections) const;
+        template <typename F>
+        void run_event_reactor(const socket& listener, F& fn) const;
+        // False when the kernel lacks multishot accept, nothing was served then
+        bool run_uring_reactor(const socket& listener, const std::function<void(epoll_state, connection&)>& fn) const;
+        void run_datagram_reactor(const socket& sock,
+                const std::function<void(const std::vector<datagram>&, datagram_queue&)>& fn, bool offload,
+                size_t datagram_size) const;
         std::pair<socket, address> accept() const;
         std::pair<socket, address> accept(const socket& s) const;
+        // Drains the backlog into batch, false when the kernel ran short and the listener needs another try
+        bool accept(const socket& s, std::vector<std::pair<socket, address>>& batch, int flags) const;
+        template <typename F>
+        static void serve(F& fn, std::pair<socket, address>& pac, std::mutex& shared);
+        template <typename F>
+        static void serve(F& fn, std::pair<socket, address>& pac, std::mutex& shared, std::true_type);
+        template <typename F>
+        static void serve(F& fn, std::pair<socket, address>& pac, std::mutex& shared, std::false_type);
 
     private:
+        static const size_t epoll_accept_batch_hint = 64;
+        static const unsigned long accept_retry_hint = 10;
+        static const unsigned uring_buffer_count = 1024;
+        static const unsigned uring_buffer_size = 4096;
+        static const size_t datagram_batch_hint = 64;
+        // SCM_MAX_FD, the most listeners one handoff carries
+        static const size_t handoff_listeners_hint = 253;
+
         connection_info conn_ctx_;
         address bind_addr_;
         socket bind_sock_;
-        mutable std::mutex iomutex_;
+        bool reuse_port_;
+        // SO_REUSEPORT twins of bind_sock_, made by spawn_reactors() or adopted; guarded for the handoff
+        mutable std::vector<socket> twins_;
+        mutable std::mutex twins_mutex_;
+        socket wake_;
+        // Handed to the handlers taking a mutex, shared with the threads that outlive the accept loops
+        std::shared_ptr<std::mutex> iomutex_;
+        std::atomic<bool> stop_;
+        std::atomic<long long> deadline_;
+        std::thread handoff_;
+        mutable std::mutex metrics_mutex_;
+        mutable std::vector<std::unique_ptr<reactor_metrics>> metrics_;
+};
+
+// Handler templates: with a lambda the compiler sees through the whole event loop
+
+template <typename F>
+const server& server::accept_block(F fn) const
+{
+    static_assert(util::is_callable<F&, socket, address>::value ||
+            util::is_callable<F&, socket, address, std::mutex&>::value,
+            "server::accept_block() handler must take (socket, address[, std::mutex&])");
+
+    reactor_metrics::scope instrumented(attach_metrics());
+    std::vector<const socket*> ready;
+
+    while (wait_accept(ready))
+    {
+        for (const socket* listener : ready)
+        {
+            std::pair<socket, address> pac = accept(*listener);
+
+            if (pac.first >= 0)
+            {
+                serve(fn, pac, *iomutex_);
+            }
+        }
+    }
+
+    std::vector<std::pair<socket, address>> backlog;
+    take_backlog(backlog);
+
+    for (auto& pac : backlog)
+    {
+        if (std::chrono::steady_clock::now() < deadline())
+        {
+            serve(fn, pac, *iomutex_);
+        }
+    }
+
+    return *this;
+}
+
+template <typename F>
+const server& server::accept_async(F fn) const
+{
+    static_assert(util::is_callable<F&, socket, address>::value ||
+            util::is_callable<F&, socket, address, std::mutex&>::value,
+            "server::accept_async() handler must take (socket, address[, std::mutex&])");
+
+    // Counts accepts only, handlers run on their own threads
+    reactor_metrics::scope instrumented(attach_metrics());
+    std::shared_ptr<F> handler = std::make_shared<F>(std::move(fn));
+    tracker_t connections = std::make_shared<tracker>();
+    std::shared_ptr<std::mutex> iomutex = iomutex_;
+
+    auto spawn = [&](std::pair<socket, address>&& accepted)
+    {
+        const int handle = connections->enter(accepted.first);
+
+        try
+        {
+            // The accepted pair moves into the thread's own state, handler, tracker and mutex
+            // are shared so a thread outliving stop() keeps them alive
+            std::thread worker([handler, connections, iomutex, handle](std::pair<socket, address>&& pac)
+            {
+                tracker::guard done(*connections, handle);
+
+                try
+                {
+                    serve(*handler, pac, *iomutex);
+                }
+                catch(std::exception& e)
+                {
+                    std::cerr << "server handler exception: " << e.what() << std::endl;
+                }
+            }, std::move(accepted));
+
+            if (worker.joinable())
+            {
+                worker.detach();
+            }
+        }
+        catch(...)
+        {
+            connections->leave(handle);
+            throw;
+        }
+    };
+
+    std::vector<const socket*> ready;
+
+    while (wait_accept(ready))
+    {
+        for (const socket* listener : ready)
+        {
+            std::pair<socket, address> pac = accept(*listener);
+
+            if (pac.first >= 0)
+            {
+                spawn(std::move(pac));
+            }
+        }
+    }
+
+    std::vector<std::pair<socket, address>> backlog;
+    take_backlog(backlog);
+
+    for (auto& pac : backlog)
+    {
+        spawn(std::move(pac));
+    }
+
+    connections->wait_until(deadline());
+
+    return *this;
+}
+
+template <typename F>
+const server& server::accept_epoll(F fn) const
+{
+    static_assert(util::is_callable<F&, socket, address>::value ||
+            util::is_callable<F&, socket, address, std::mutex&>::value,
+            "server::accept_epoll() handler must take (socket, address[, std::mutex&])");
+
+    std::shared_ptr<F> handler = std::make_shared<F>(std::move(fn));
+    tracker_t connections = std::make_shared<tracker>();
+
+    // One reactor, plus one for each twin handed over by a predecessor
+    spawn_reactors(1, [&](const socket& listener)
+    {
+        run_reactor(listener, handler, connections);
+    });
+
+    connections->wait_until(deadline());
+
+    return *this;
+}
+
+template <typename F>
+const server& server::accept_reactors(F fn, size_t reactors) const
+{
+    static_assert(util::is_callable<F&, socket, address>::value ||
+            util::is_callable<F&, socket, address, std::mutex&>::value,
+            "server::accept_reactors() handler must take (socket, address[, std::mutex&])");
+
+    std::shared_ptr<F> handler = std::make_shared<F>(std::move(fn));
+    tracker_t connections = std::make_shared<tracker>();
+
+    spawn_reactors(reactors, [&](const socket& listener)
+    {
+        run_reactor(listener, handler, connections);
+    });
+
+    connections->wait_until(deadline());
+
+    return *this;
+}
+
+template <typename F>
+const server& server::accept_events(F fn, size_t reactors, engine kind) const
+{
+    static_assert(util::is_callable<F&, epoll_state, connection&>::value,
+            "server::accept_events() handler must take (epoll_state, connection&)");
+
+    spawn_reactors(reactors, [&](const socket& listener)
+    {
+        // Completion loop stays out of line, the handler is only wrapped by reference.
+        // Kernels it does not run on get the epoll reactor instead
+        if (kind != engine::ENGINE_URING ||
+            !run_uring_reactor(listener, std::function<void(epoll_state, connection&)>(std::ref(fn))))
+        {
+            run_event_reactor(listener, fn);
+        }
+    });
+
+    return *this;
+}
+
+template <typename F>
+const server& server::accept_http(F fn, size_t reactors, engine kind) const
+{
+    static_assert(util::is_callable<F&, const http_request&, connection&>::value,
+            "server::accept_http() handler must take (const http_request&, connection&)");
+
+    return accept_events([&fn](epoll_state state, connection& conn)
+    {
+        if (state != epoll_state::EPOLL_READ)
+        {
+            return;
+        }
+
+        conn.receive();
+
+        // Pipelined requests are answered in order through the connection's queue, one
+        // parser per reactor thread keeps its header table from being reallocated
+        static thread_local http_request request;
+        buffer& input = conn.input();
+
+        reactor_metrics* shard = reactor_metrics::current();
+        std::chrono::steady_clock::time_point started;
+        if (shard)
+        {
+            started = std::chrono::steady_clock::now();
+        }
+
+        request.clear();
+
+        while (!input.empty() && !conn.closed())
+        {
+            parse_state rc = request.parse(input.data(), input.size());
+
+            if (rc == parse_state::PARSE_INCOMPLETE)
+            {
+                break;
+            }
+
+            if (rc == parse_state::PARSE_ERROR)
+            {
+                static const char bad_request[] =
+                    "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+                conn.send(slice(bad_request, sizeof(bad_request) - 1));
+                conn.close();
+                break;
+            }
+
+            fn(request, conn);
+
+            if (!request.keep_alive())
+            {
+                conn.close();
+            }
+
+            input.consume(request.length());
+            request.clear();
+
+            if (shard)
+            {
+                // The next pipelined request starts where this one ended
+                const std::chrono::steady_clock::time_point finished = std::chrono::steady_clock::now();
+                shard->record(latency::LATENCY_REQUEST, finished - started);
+                started = finished;
+            }
+        }
+    }, reactors, kind);
+}
+
+template <typename F>
+const server& server::serve_datagrams(F fn, size_t reactors, bool offload, size_t datagram_size) const
+{
+    static_assert(util::is_callable<F&, const std::vector<datagram>&, datagram_queue&>::value,
+            "server::serve_datagrams() handler must take (const std::vector<datagram>&, datagram_queue&)");
+
+    spawn_reactors(reactors, [&](const socket& sock)
+    {
+        // Called once per batch, wrapping the handler by reference costs nothing per datagram
+        run_datagram_reactor(sock, std::function<void(const std::vector<datagram>&, datagram_queue&)>(std::ref(fn)),
+                offload, datagram_size);
+    });
+
+    return *this;
+}
+
+template <typename F>
+void server::serve(F& fn, std::pair<socket, address>& pac, std::mutex& shared)
+{
+    serve(fn, pac, shared, std::integral_constant<bool, util::is_callable<F&, socket, address>::value>());
+}
+
+template <typename F>
+void server::serve(F& fn, std::pair<socket, address>& pac, std::mutex&, std::true_type)
+{
+    // A connection belongs to the one thread serving it, nothing to lock
+    fn(std::move(pac.first), std::move(pac.second));
+}
+
+template <typename F>
+void server::serve(F& fn, std::pair<socket, address>& pac, std::mutex& shared, std::false_type)
+{
+    fn(std::move(pac.first), std::move(pac.second), shared);
+}
+
+template <typename F>
+void server::run_reactor(const socket& listener, const std::shared_ptr<F>& fn, const tracker_t& connections) const
+{
+    reactor_metrics::scope instrumented(attach_metrics());
+    std::vector<std::pair<socket, address>> batch;
+    batch.reserve(epoll_accept_batch_hint);
+
+    std::shared_ptr<std::mutex> iomutex = iomutex_;
+
+    epoll ep;
+    listener.nonblocking();
+    ep.add_socket(listener);
+    ep.add_socket(wake_, 0, false);
+
+    auto launch = [&]()
+    {
+        for (auto& accepted : batch)
+        {
+            const int handle = connections->enter(accepted.first);
+
+            try
+            {
+                std::thread worker([fn, connections, iomutex, handle](std::pair<socket, address>&& pac)
+                {
+                    tracker::guard done(*connections, handle);
+
+                    try
+                    {
+                        serve(*fn, pac, *iomutex);
+                    }
+                    catch(std::exception& e)
+                    {
+                        std::cerr << "server handler exception: " << e.what() << std::endl;
+                    }
+                }, std::move(accepted));
+
+                if (worker.joinable())
+                {
+                    worker.detach();
+                }
+            }
+            catch(...)
+            {
+                connections->leave(handle);
+                throw;
+            }
+        }
+
+        batch.clear();
+    };
+
+    bool drained = true;
+
+    while ( !stop_ )
+    {
+        ep.wait(drained ? 1000 : accept_retry_hint);
+
+        if (!drained)
+        {
+            drained = accept(listener, batch, SOCK_CLOEXEC);
+            launch();
+        }
+
+        ep.dispatch([&](epoll_state state, const socket& sock)
+        {
+            if (static_cast<int>(sock) == static_cast<int>(listener) &&
+                (state == epoll_state::EPOLL_READ || state == epoll_state::EPOLL_WRITE))
+            {
+                // Handlers do blocking I/O, keep accepted sockets blocking
+                drained = accept(listener, batch, SOCK_CLOEXEC);
+                launch();
+            }
+        });
+    }
+
+    take_backlog(listener, batch);
+    launch();
+}
+
+template <typename F>
+void server::run_event_reactor(const socket& listener, F& fn) const
+{
+    reactor_metrics::scope instrumented(attach_metrics());
+    std::vector<std::pair<socket, address>> batch;
+    batch.reserve(epoll_accept_batch_hint);
+
+    // Connections and their buffers are recycled by this reactor only
+    block_pool blocks;
+    slab<connection> connections;
+    std::vector<connection*> by_fd(epoll::epoll_queue_size_hint, 0);
+    bool draining = false;
+    bool drained = true;
+
+    epoll ep;
+    listener.nonblocking();
+    ep.add_socket(listener);
+    ep.add_socket(wake_, 0, false);
+
+    auto release = [&](connection* conn)
+    {
+        by_fd[conn->sock()] = 0;
+        ep.remove_socket(conn->sock());
+        connections.destroy(conn);
+    };
+
+    auto admit = [&]()
+    {
+        drained = accept(listener, batch, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        for (auto& accepted : batch)
+        {
+            const size_t fd = static_cast<int>(accepted.first);
+            connection* conn = connections.make(std::move(accepted.first), std::move(accepted.second),
+                    &ep, &blocks);
+
+            if (fd >= by_fd.size())
+            {
+                by_fd.resize(fd + 1, 0);
+            }
+
+            by_fd[fd] = conn;
+
+            try
+            {
+                ep.add_socket(conn->sock(), conn, false);
+            }
+            catch(...)
+            {
+                by_fd[fd] = 0;
+                connections.destroy(conn);
+                throw;
+            }
+        }
+
+        batch.clear();
+    };
+
+    // Nothing read, nothing queued and nothing waiting in the socket
+    auto idle = [](const connection& conn)
+    {
+        return !conn.pending() && conn.input_.empty() && !conn.sock().available();
+    };
+
+    auto handler = [&](epoll_state state, const socket& sock, void* data)
+    {
+        if (!data)
+        {
+            if (static_cast<int>(sock) == static_cast<int>(listener) &&
+                (state == epoll_state::EPOLL_READ || state == epoll_state::EPOLL_WRITE))
+            {
+                admit();
+            }
+
+            return;
+        }
+
+        connection& conn = *static_cast<connection*>(data);
+
+        if (state == epoll_state::EPOLL_WRITE)
+        {
+            // Write events only reach the handler once a congested queue drains
+            conn.flush();
+
+            if (!conn.closed() && conn.resumed())
+            {
+                fn(state, conn);
+            }
+        }
+        else if (!conn.closed())
+        {
+            fn(state, conn);
+        }
+
+        // A combined IN|OUT edge is reported as a read, flush here so it is not lost
+        if (conn.pending())
+        {
+            conn.flush();
+        }
+
+        if ((conn.closed() && !conn.pending()) || (draining && idle(conn)) ||
+            state == epoll_state::EPOLL_CLOSE || state == epoll_state::EPOLL_ERROR)
+        {
+            release(&conn);
+        }
+    };
+
+    auto release_all = [&]()
+    {
+        for (connection* conn : by_fd)
+        {
+            if (conn)
+            {
+                release(conn);
+            }
+        }
+    };
+
+    // Stops accepting, from then on connections are closed as soon as they go idle
+    auto drain = [&]()
+    {
+        draining = true;
+
+        // Take what already sits in the backlog, later arrivals wait for whoever holds the listener next
+        admit();
+        ep.remove_socket(listener);
+
+        for (connection* conn : by_fd)
+        {
+            if (conn && idle(*conn))
+            {
+                release(conn);
+            }
+        }
+    };
+
+    try
+    {
+        while (!draining || connections.live())
+        {
+            ep.wait(draining ? remaining_ms() : drained ? 1000 : accept_retry_hint);
+
+            // The listener turned accepts away for lack of memory, no new edge announces the rest
+            if (!drained && !draining)
+            {
+                admit();
+            }
+
+            ep.dispatch(handler);
+
+            if (!draining && stop_)
+            {
+                drain();
+            }
+            else if (draining && std::chrono::steady_clock::now() >= deadline())
+            {
+                break;
+            }
+        }
+    }
+    catch(...)
+    {
+        release_all();
+        throw;
+    }
+
+    release_all();
+}
+
+// Host name lookups with a cache. getaddrinfo() reports no TTL, an answer is kept for ttl_ms.
+// Asynchronous lookups run on the resolver's own thread and complete in whichever thread calls
+// dispatch(): a reactor adds sock() to its epoll and dispatches when it turns readable
+class resolver
+{
+    public:
+        static const unsigned long resolver_ttl_hint = 30000;
+
+        typedef std::vector<address> addresses_t;
+        // On failure the addresses are empty and error says why
+        typedef std::function<void(const addresses_t&, const std::string&)> handler_t;
+
+        resolver(unsigned long ttl_ms = resolver_ttl_hint);
+        virtual ~resolver();
+
+        // No copy, no move
+        resolver(const resolver&) = delete;
+        resolver(resolver&&) = delete;
+        resolver& operator=(const resolver&) = delete;
+        resolver& operator=(resolver&&) = delete;
+
+        // Process wide instance behind parse_connection_string() and client::connect()
+        static resolver& shared();
+
+        // Every address of host, in the order to try them: families alternate, the preferred one first.
+        // Literal addresses come back without a lookup. Blocks the caller on a cache miss
+        addresses_t resolve(const std::string& host, unsigned short port, int family = AF_UNSPEC,
+                            int type = SOCK_STREAM);
+        // Never blocks: fn is queued for dispatch(), straight from the cache or after the lookup thread is done
+        void resolve(const std::string& host, unsigned short port, handler_t fn, int family = AF_UNSPEC,
+                     int type = SOCK_STREAM);
+
+        // Readable while completions are waiting for dispatch()
+        const socket& sock() const;
+        size_t dispatch();
+
+        size_t cached() const;
+        void clear();
+
+    private:
+        struct entry
+        {
+            addresses_t addresses;
+            std::chrono::steady_clock::time_point expires;
+        };
+
+        struct query
+        {
+            std::string host;
+            unsigned short port;
+            int family;
+            int type;
+            handler_t fn;
+        };
+
+        struct completion
+        {
+            addresses_t addresses;
+            std::string error;
+            handler_t fn;
+        };
+
+        static std::string key(const std::string& host, unsigned short port, int family, int type);
+        static bool literal(const std::string& host, unsigned short port, int family, addresses_t& addresses);
+
+        bool lookup_cached(const std::string& key, addresses_t& addresses);
+        addresses_t lookup(const std::string& host, unsigned short port, int family, int type, std::string& error);
+        void complete(completion&& done);
+        void run();
+
+    private:
+        const unsigned long ttl_ms_;
+        mutable std::mutex mutex_;
+        std::condition_variable ready_;
+        std::unordered_map<std::string, entry> cache_;
+        std::deque<query> queries_;
+        std::deque<completion> completions_;
+        socket wake_;
+        bool stop_;
+        std::thread thread_;
 };
 
 class client
 {
     public:
+        static const unsigned long connect_attempt_hint = 250;
+
         client();
         virtual ~client();
 
         // No copy, no move
-        client(const server&) = delete;
-        client(server&&) = delete;
+        client(const client&) = delete;
+        client(client&&) = delete;
         client& operator=(const client&) = delete;
         client& operator=(client&&) = delete;
 
+        // Blocking connect to "tcp:host:port", "tcp:[v6]:port", "unix:/path" or "unix:@name", an open connection is
+        // replaced. A host with several addresses is raced Happy Eyeballs style (RFC 8305): the next address gets
+        // its attempt after connect_attempt_hint ms, the first to connect wins
         const client& connect(std::string conn);
         const client& disconnect();
 
+        const socket& sock() const;
+        const address& addr() const;
+
     private:
         socket socket_;
+        address address_;
+};
+
+// Asynchronous HTTP/1.1 client for fanning out to backends. Connections are kept alive in a pool per
+// destination ("tcp:host:port" as for client::connect), connect without blocking and carry up to
+// pipeline requests at a time. Like a reactor it belongs to the one thread that calls run(),
+// handlers run there too
+class http_client
+{
+    public:
+        static const size_t client_max_idle_hint = 8;
+        static const size_t client_max_total_hint = 32;
+        static const size_t client_pipeline_hint = 4;
+
+        // response is only valid while the handler runs, on failure error says why
+        typedef std::function<void(const http_response& response, const std::string& error)> handler_t;
+
+        http_client(size_t max_idle = client_max_idle_hint, size_t max_total = client_max_total_hint,
+                    size_t pipeline = client_pipeline_hint);
+        virtual ~http_client();
+
+        // No copy, no move
+        http_client(const http_client&) = delete;
+        http_client(http_client&&) = delete;
+        http_client& operator=(const http_client&) = delete;
+        http_client& operator=(http_client&&) = delete;
+
+        // request is a complete HTTP/1.1 request, head and body
+        void send(const std::string& conn, const std::string& request, handler_t fn);
+        void get(const std::string& conn, const std::string& target, handler_t fn);
+
+        // Waits up to ms for sockets and lookups, runs the handlers of what completed; the count of those
+        size_t run(unsigned long ms = 0);
+
+        // Requests not answered yet, open connections and the idle ones among them
+        size_t pending() const;
+        size_t connections() const;
+        size_t idle() const;
+
+    private:
+        struct request
+        {
+            std::string bytes;
+            handler_t fn;
+            bool head;
+            // Safe to send twice (RFC 7231 4.2.2), the only kind retried
+            bool idempotent;
+            bool retried;
+        };
+
+        struct destination;
+
+        struct outbound
+        {
+            std::unique_ptr<connection> conn;
+            destination* dest;
+            size_t candidate;
+            bool connected;
+            // A response came back on it already: closing before the next one is a stale keep-alive
+            bool reused;
+            // No keep-alive, takes no more requests
+            bool closing;
+            // A handler runs on response, the parser is reset once it returns
+            bool delivering;
+            std::deque<request> in_flight;
+            http_response response;
+        };
+
+        struct destination
+        {
+            std::string conn;
+            std::string host;
+            int family;
+            connection_info info;
+            std::vector<address> candidates;
+            // The candidate that connected last, where new connections start, and the refusals since
+            size_t preferred;
+            size_t failures;
+            bool resolving;
+            std::deque<request> waiting;
+            std::vector<std::unique_ptr<outbound>> connections;
+        };
+
+        destination& find(const std::string& conn);
+        void schedule(destination& dest);
+        outbound* open(destination& dest);
+        void assign(outbound& out, request&& req);
+        size_t handle(outbound& out, epoll_state state);
+        // With retry, idempotent requests a reused connection left unanswered go back to the destination
+        // once (RFC 7230 6.3.1), the rest fail with error
+        void retire(outbound& out, bool retry, const std::string& error);
+        void fail(std::deque<request>& requests, const std::string& error);
+
+    private:
+        const size_t max_idle_;
+        const size_t max_total_;
+        const size_t pipeline_;
+        epoll poller_;
+        std::unordered_map<std::string, std::unique_ptr<destination>> destinations_;
+        std::vector<std::unique_ptr<outbound>> retired_;
+        // Failures wait for run(), handlers never run inside send()
+        std::deque<std::pair<request, std::string>> failed_;
+        size_t completed_;
+        // Last: destroyed first, no lookup completes into a client going away
+        resolver names_;
 };
 
 namespace util
 {
     bool is_ignored_error(int ec);
+
+    // "tcp:host:port", "udp:host:port", "unix:/path" or "unix:@abstract" ("unixpacket:" for SOCK_SEQPACKET).
+    // An IPv6 host goes in brackets, "tcp:[::1]:8080", an empty host stands for any IPv4 address.
+    // "tcp4"/"tcp6" and "udp4"/"udp6" pin the address family, "tcp6::port" binds a dual-stack listener
+    connection_info parse_connection_string(std::string conn);
+    // Every candidate address in the order to try them, info is filled in for the first one
+    std::vector<address> resolve_connection_string(std::string conn, connection_info& info,
+                                                   resolver& names = resolver::shared());
+    std::vector<std::string> split_connection_string(std::string conn);
 } /* namespace util */
 
 } /* namespace ha */
@@ -250,7 +2221,7 @@ namespace util
 std::ostream& operator<< (std::ostream &out, ha::socket &s);
 std::istream& operator>> (std::istream &in, ha::socket &s);
 
-std::ostream& operator<< (std::ostream &out, ha::address &a);
+std::ostream& operator<< (std::ostream &out, const ha::address &a);
 std::istream& operator>> (std::istream &in, ha::address &a);
 
 #endif  /* _HENET_H_ */
@@ -6,6 +6,26 @@
 
 #include "henet.h"
 
+// Usage: henet.git [mode [body bytes [listen on]]]
+//     mode: http (default), uring, block, async, epoll, reactors, pool
+//     listen on: tcp::8080 (default), tcp6::8080, unix:/tmp/hetest.http, unix:@hetest ...
+
+namespace
+{
+    std::atomic<ha::server*> running(nullptr);
+
+    // SIGTERM/SIGINT drain the server instead of dropping in-flight responses
+    void on_signal(int)
+    {
+        ha::server* server = running;
+
+        if (server)
+        {
+            server->stop();
+        }
+    }
+}
+
 int main(int argc, char** argv)
 {
     int rc = EXIT_SUCCESS;
@@ -20,36 +40,108 @@ int main(int argc, char** argv)
         {
             try
             {
+                const std::string mode = argc > 1 ? argv[1] : "http";
+
+                // Responses are rendered once, Date is refreshed every second. The executable
+                // itself is served unless a body size is given
+                ha::response_cache responses(1000);
+                ha::response_cache::headers_t headers =
+                    {
+                        { "Server", "henet" },
+                        { "Content-type", "application/octet-stream" },
+                        { "Content-Transfer-Encoding", "8bit" },
+                        { "Connection", "keep-alive" }
+                    };
+                // Keep-alive is spelled out, HTTP/1.0 clients (ab -k) would wait for the close otherwise
+                ha::response_cache::slot_t reply = argc > 2 ?
+                    responses.add("/", 200, headers, std::string(std::atoi(argv[2]), 'x'), true) :
+                    responses.add_file("/", 200, headers, argv[0], true);
+
+                // Thread per connection modes answer once and close, as does http for a client asking to
+                headers.back().second = "close";
+                ha::response_cache::slot_t last_reply = argc > 2 ?
+                    responses.add("/close", 200, headers, std::string(std::atoi(argv[2]), 'x'), true) :
+                    responses.add_file("/close", 200, headers, argv[0], true);
+
+                // A second instance takes the port over from the running one, which then drains
+                const std::string handoff = "/tmp/hetest.sock";
+
                 ha::server server;
-                server.bind("tcp::8080").listen();
-                server.accept_epoll([&](ha::socket s, ha::address a, std::mutex& m)
+                if (!server.adopt_from(handoff))
                 {
-                    // Notify connected
-                    //std::cout << "Client connected. Endpoint: " << a << ", socket: " << s << std::endl;
+                    // Only the reactors mode shards the port over several listeners
+                    server.bind(argc > 3 ? argv[3] : "tcp::8080", mode == "reactors");
+                }
+                server.listen();
+                server.share(handoff);
 
-                    // Read request
-                    std::vector<unsigned char> raw_request = s.read();
-                    const std::string str_request(raw_request.begin(), raw_request.end());
+                running = &server;
+                ::signal(SIGTERM, on_signal);
+                ::signal(SIGINT, on_signal);
 
-                    //std::cout << "Client request: " << std::endl << str_request << std::endl;
+                auto respond = [&](const ha::http_request& request, ha::connection& c)
+                {
+                    // Notify request
+                    //std::cout << "Client request: " << request.method().str() << " " << request.target().str()
+                    //          << ", endpoint: " << c.addr().str() << std::endl;
 
                     // Send reply
-                    const char crlf[] = "\x0D\x0A";
-                    std::stringstream stream;
-                    stream << "HTTP/1.1 200 OK"                         << crlf
-                           << "Server: henet"                           << crlf
-                           << "Content-type: application/octet-stream"  << crlf
-                           << "Content-Transfer-Encoding: 8bit"         << crlf
-                           //<< "Content-Length: " << 0                 << crlf
-                           << "Connection: close"                       << crlf
-                           << crlf;
-
-                    std::unique_lock<std::mutex> lock(m);
-                    s.write(stream.str());
-                    s.write_file(argv[0]);
-
-                    //std::cout << "Reply sent: " << std::endl << str_reply << std::endl;
-                });
+                    c.send(request.keep_alive() ? reply->load() : last_reply->load());
+                };
+
+                auto answer = [&](ha::socket s, ha::address a, std::mutex& m)
+                {
+                    // Read request
+                    s.read();
+
+                    // Send reply
+                    const ha::response_cache::response_t response = last_reply->load();
+                    s.write(response->head());
+
+                    if (response->body())
+                    {
+                        off_t offset = 0;
+                        s.write_file(*response->body(), offset);
+                    }
+                };
+
+                if (mode == "http")
+                {
+                    server.accept_http(respond);
+                }
+                else if (mode == "uring")
+                {
+                    server.accept_http(respond, 1, ha::engine::ENGINE_URING);
+                }
+                else if (mode == "block")
+                {
+                    server.accept_block(answer);
+                }
+                else if (mode == "async")
+                {
+                    server.accept_async(answer);
+                }
+                else if (mode == "epoll")
+                {
+                    server.accept_epoll(answer);
+                }
+                else if (mode == "reactors")
+                {
+                    server.accept_reactors(answer);
+                }
+                else if (mode == "pool")
+                {
+                    ha::thread_pool pool;
+                    server.accept_pool(answer, pool);
+                }
+                else
+                {
+                    throw std::runtime_error("Unknown mode: " + mode);
+                }
+
+                running = nullptr;
+
+                std::cout << server.metrics().str();
             }
             catch(std::exception& e)
             {